@@ -1,5 +1,10 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <blk.h>
 #include "cache.h"
 #include "client.h"
@@ -14,6 +19,26 @@ static inline int cblk_dirty(const cblk_t *cblk)
 	return cblk->flags & CACHE_DIRTY;
 }
 
+static inline int cblk_ref(const cblk_t *cblk)
+{
+	return cblk->flags & CACHE_REF;
+}
+
+static inline int cblk_busy(const cblk_t *cblk)
+{
+	return cblk->flags & CACHE_BUSY;
+}
+
+static inline int cblk_stale(const cblk_t *cblk)
+{
+	return cblk->flags & CACHE_STALE;
+}
+
+static inline int cblk_wb(const cblk_t *cblk)
+{
+	return cblk->flags & CACHE_WB;
+}
+
 static inline void cblk_set_valid(cblk_t *cblk, int valid)
 {
 	if (valid)
@@ -26,112 +51,415 @@ static inline void cblk_set_valid(cblk_t *cblk, int valid)
 	}
 }
 
-static inline void cblk_set_dirty(cblk_t *cblk, int dirty)
+static inline void cblk_set_ref(cblk_t *cblk, int ref)
 {
-	if (dirty)
+	if (ref)
 	{
-		cblk->flags |= CACHE_DIRTY;
+		cblk->flags |= CACHE_REF;
 	}
 	else
 	{
-		cblk->flags &= ~CACHE_DIRTY;
+		cblk->flags &= ~CACHE_REF;
 	}
 }
 
 static void cblk_init(cblk_t *cblk)
 {
 	cblk->flags = 0;
+	cblk->pins = 0;
+	cblk->gen = 0;
 }
 
-static int cblk_flush(cblk_t *cblk, client_t *cl)
+static time_t cache_now(void)
 {
-	int	ret	= 0;
-	blk_t	blk;
+	struct timespec ts;
 
-	if (cblk_valid(cblk) && cblk_dirty(cblk))
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/*
+ * Every change bumps the generation of the slot, even one to a block that is
+ * dirty already, so a write-back that raced with it can tell.
+ */
+static void cache_set_dirty(cache_shard_t *shard, cblk_t *cblk, int dirty)
+{
+	if (dirty)
+	{
+		cblk->gen++;
+	}
+
+	if (dirty && !cblk_dirty(cblk))
+	{
+		cblk->flags |= CACHE_DIRTY;
+		cblk->dirtied = cache_now();
+		shard->n_dirty++;
+	}
+	else if (!dirty && cblk_dirty(cblk))
 	{
-		memcpy(blk.data, cblk->data, sizeof(cblk->data));
+		cblk->flags &= ~CACHE_DIRTY;
+		shard->n_dirty--;
+	}
+}
+
+/*
+ * A cache is split into shards, each with its own lock, slots, index and
+ * CLOCK hand, and a block always lives in the shard its id hashes to. The
+ * shard lock is held to look up, pin and unpin blocks, never for a round
+ * trip: slots that are in flight are marked busy or under write-back and the
+ * lock is let go. Users keep a block pinned for as long as they hold a
+ * pointer to it, which is what keeps it from being replaced.
+ */
 
-		ret = client_wr_blk(cl, &blk, cblk->id);
+static inline cache_shard_t *cache_shard(cache_t *cache, blk_id_t id)
+{
+	uint64_t hash = id * UINT64_C(0x9E3779B97F4A7C15);
+
+	return &cache->shard[(hash >> (64 - CACHE_SHARD_BITS)) &
+				(cache->n_shard - 1)];
+}
+
+/*
+ * Valid slots are indexed by block id in an open addressing table with linear
+ * probing. The table is kept at most half full, and removal shifts displaced
+ * entries back so no tombstones are needed.
+ */
+
+static inline unsigned idx_hash(const cache_shard_t *shard, blk_id_t id)
+{
+	return (id * UINT64_C(0x9E3779B97F4A7C15)) >> 32 & shard->idx_mask;
+}
+
+static int *idx_find(cache_shard_t *shard, blk_id_t id)
+{
+	unsigned i = idx_hash(shard, id);
 
-		if (ret == 0)
+	while (shard->idx[i] != -1)
+	{
+		if (shard->blk[shard->idx[i]].id == id)
 		{
-			cblk_set_dirty(cblk, 0);
+			return &shard->idx[i];
 		}
+
+		i = (i + 1) & shard->idx_mask;
 	}
 
-	return ret;
+	return NULL;
 }
 
-static int cblk_fetch(cblk_t *cblk, blk_id_t id, client_t *cl)
+static void idx_insert(cache_shard_t *shard, blk_id_t id, int slot)
 {
-	int	ret	= cblk_flush(cblk, cl);
-	blk_t	blk;
+	unsigned i = idx_hash(shard, id);
 
-	if (ret != 0)
+	while (shard->idx[i] != -1)
 	{
-		return ret;
+		i = (i + 1) & shard->idx_mask;
 	}
 
-	ret = client_rd_blk(cl, &blk, id);
+	shard->idx[i] = slot;
+}
 
-	if (ret != 0)
+static void idx_remove(cache_shard_t *shard, blk_id_t id)
+{
+	int *		ent	= idx_find(shard, id);
+	unsigned	i;
+	unsigned	j;
+
+	if (ent == NULL)
 	{
-		return ret;
+		return;
+	}
+
+	i = ent - shard->idx;
+	j = i;
+
+	for (;;)
+	{
+		unsigned home;
+
+		shard->idx[i] = -1;
+
+		do
+		{
+			j = (j + 1) & shard->idx_mask;
+
+			if (shard->idx[j] == -1)
+			{
+				return;
+			}
+
+			home = idx_hash(shard, shard->blk[shard->idx[j]].id);
+		}
+		while (((j - home) & shard->idx_mask) <
+			((j - i) & shard->idx_mask));
+
+		shard->idx[i] = shard->idx[j];
+		i = j;
 	}
+}
 
-	memcpy(cblk->data, blk.data, sizeof(cblk->data));
+static void cache_bind(cache_shard_t *shard, cblk_t *cblk, blk_id_t id)
+{
+	if (cblk_valid(cblk))
+	{
+		idx_remove(shard, cblk->id);
+	}
 
 	cblk->id = id;
-	cblk->flags = CACHE_VALID;
+	cblk->gen++;
+
+	idx_insert(shard, id, cblk - shard->blk);
+}
+
+/*
+ * Write out a dirty block so its slot can be reused. It is encrypted in
+ * place, since the plaintext is not needed afterwards, and the slot is kept
+ * busy for the round trip so nobody reads it in the meantime. The shard lock
+ * is let go meanwhile, so the caller has to look again afterwards.
+ */
+static int cache_clean(cache_t *cache, cache_shard_t *shard, cblk_t *cblk)
+{
+	blk_id_t	id	= cblk->id;
+	int		ret;
+
+	cblk->flags |= CACHE_BUSY;
+	cblk->pins++;
+
+	pthread_mutex_unlock(&shard->lock);
+	ret = client_wr_blk(cache->cl, &cblk->blk, &cblk->blk, id);
+	pthread_mutex_lock(&shard->lock);
+
+	cblk->pins--;
+	cblk->flags &= ~CACHE_BUSY;
+
+	if (ret == 0)
+	{
+		cache_set_dirty(shard, cblk, 0);
+		idx_remove(shard, id);
+		cblk->flags = 0;
+	}
+
+	pthread_cond_broadcast(&shard->done);
 
 	return ret;
 }
 
-static cblk_t *cache_find_blk(cache_t *cache, blk_id_t id)
+/*
+ * The slot is bound to the block and pinned while it is read, and the shard
+ * lock is let go for the round trip. Other threads keep using the shard in
+ * the meantime, and those that want this block wait for it to land.
+ */
+static int cache_fetch(cache_t *cache, cache_shard_t *shard, cblk_t *cblk,
+			blk_id_t id)
 {
-	for (int i = 0; i < cache->n_blk; i++)
+	int ret;
+
+	cache_bind(shard, cblk, id);
+	cblk->flags = CACHE_BUSY;
+	cblk->pins++;
+
+	pthread_mutex_unlock(&shard->lock);
+	ret = client_rd_blk(cache->cl, &cblk->blk, id);
+	pthread_mutex_lock(&shard->lock);
+
+	cblk->pins--;
+
+	if (ret != 0)
+	{
+		idx_remove(shard, id);
+		cblk->flags = 0;
+	}
+	else
+	{
+		cblk->flags = CACHE_VALID;
+	}
+
+	pthread_cond_broadcast(&shard->done);
+
+	return ret;
+}
+
+static cblk_t *cache_find_blk(cache_shard_t *shard, blk_id_t id)
+{
+	int *ent = idx_find(shard, id);
+
+	if (ent != NULL)
 	{
-		cblk_t *cblk = &cache->blk[i];
+		return &shard->blk[*ent];
+	}
+
+	return NULL;
+}
+
+/*
+ * Pick a slot to replace with CLOCK: the hand sweeps the slots, giving every
+ * block that was referenced since the last pass a second chance. Pinned
+ * blocks and those being written back are never replaced, and after two full
+ * passes every other block has lost its reference bit, so finding none means
+ * the shard is all taken.
+ */
+static cblk_t *cache_victim(cache_shard_t *shard)
+{
+	for (int i = 0; i < 2 * shard->n_blk; i++)
+	{
+		cblk_t *cblk = &shard->blk[shard->hand];
+
+		shard->hand = (shard->hand + 1) % shard->n_blk;
+
+		if (cblk->pins != 0 || cblk_wb(cblk))
+		{
+			continue;
+		}
 
-		if (cblk_valid(cblk) && cblk->id == id)
+		if (!cblk_valid(cblk) || !cblk_ref(cblk))
 		{
 			return cblk;
 		}
+
+		cblk_set_ref(cblk, 0);
 	}
 
+	errno = ENOMEM;
+
 	return NULL;
 }
 
-static cblk_t *cache_find_ptr(cache_t *cache, void *ptr)
+/*
+ * Find the slot a pointer into a block belongs to, and lock its shard. The
+ * slab only moves when nothing is pinned, and callers hold a pin on the
+ * block, so it can be looked at before the lock is taken.
+ */
+static cblk_t *cache_lock_ptr(cache_t *cache, void *ptr,
+				cache_shard_t **shard)
 {
-	for (int i = 0; i < cache->n_blk; i++)
+	size_t	off	= (char *) ptr - (char *) cache->blk;
+	int	base	= cache->n_blk / cache->n_shard;
+	cblk_t *cblk;
+	int	slot;
+
+	if (off >= sizeof(cblk_t) * cache->n_blk)
+	{
+		return NULL;
+	}
+
+	slot = off / sizeof(cblk_t);
+	cblk = &cache->blk[slot];
+
+	if (	(char *) ptr <	&cblk->data[0]				||
+		(char *) ptr >=	&cblk->data[BLK_DATA_LEN]		)
+	{
+		return NULL;
+	}
+
+	*shard = &cache->shard[slot / base < cache->n_shard ?
+				slot / base : cache->n_shard - 1];
+
+	pthread_mutex_lock(&(*shard)->lock);
+
+	if (!cblk_valid(cblk))
 	{
-		cblk_t *cblk = &cache->blk[i];
+		pthread_mutex_unlock(&(*shard)->lock);
+		return NULL;
+	}
+
+	return cblk;
+}
 
-		if (	cblk_valid(cblk)				&&
-			(char *) ptr >=	&cblk->data[0]			&&
-			(char *) ptr <	&cblk->data[BLK_DATA_LEN]	)
+/*
+ * Lay the slots out over the shards, the last one taking the odd ones. The
+ * cache is only changed once everything has been allocated.
+ */
+static int cache_alloc(cache_t *cache, int n_blk)
+{
+	int		base			= n_blk / cache->n_shard;
+	int		last			= n_blk - base * (cache->n_shard - 1);
+	int *		idx[1 << CACHE_SHARD_BITS]	= { NULL };
+	cblk_t *	blk			= malloc(sizeof*(blk) * n_blk);
+	unsigned	n_idx			= 2;
+	int		ret			= blk != NULL ? 0 : -1;
+
+	while (n_idx < 2 * (unsigned) last)
+	{
+		n_idx <<= 1;
+	}
+
+	for (int k = 0; k < cache->n_shard && ret == 0; k++)
+	{
+		idx[k] = malloc(sizeof*(idx[k]) * n_idx);
+
+		if (idx[k] == NULL)
 		{
-			return cblk;
+			ret = -1;
 		}
 	}
 
-	return NULL;
+	if (ret != 0)
+	{
+		free(blk);
+
+		for (int k = 0; k < cache->n_shard; k++)
+		{
+			free(idx[k]);
+		}
+
+		return ret;
+	}
+
+	cache->blk = blk;
+	cache->n_blk = n_blk;
+
+	for (int k = 0; k < cache->n_shard; k++)
+	{
+		cache_shard_t *shard = &cache->shard[k];
+
+		shard->blk = blk + k * base;
+		shard->n_blk = k == cache->n_shard - 1 ? last : base;
+		shard->n_dirty = 0;
+		shard->hand = 0;
+		shard->idx = idx[k];
+		shard->idx_mask = n_idx - 1;
+
+		for (unsigned i = 0; i < n_idx; i++)
+		{
+			shard->idx[i] = -1;
+		}
+	}
+
+	for (int i = 0; i < n_blk; i++)
+	{
+		cblk_init(&cache->blk[i]);
+	}
+
+	return 0;
 }
 
 cache_t *cache_new(client_t *cl, int n_blk)
 {
-	cache_t *cache = malloc(sizeof(cache_t) + sizeof(cblk_t) * n_blk);
+	cache_t *cache = malloc(sizeof(cache_t));
 
 	if (cache != NULL)
 	{
 		cache->cl = cl;
-		cache->n_blk = n_blk;
+		cache->n_shard = 1;
+
+		/* Small caches stay whole, so a shard never runs out of slots */
+		while (	cache->n_shard < 1 << CACHE_SHARD_BITS		&&
+			n_blk / (cache->n_shard * 2) >= CACHE_SHARD_MIN	)
+		{
+			cache->n_shard *= 2;
+		}
+
+		if (cache_alloc(cache, n_blk) != 0)
+		{
+			free(cache);
+			return NULL;
+		}
 
-		for (int i = 0; i < n_blk; i++)
+		for (int k = 0; k < cache->n_shard; k++)
 		{
-			cblk_init(&cache->blk[i]);
+			pthread_mutex_init(&cache->shard[k].lock, NULL);
+			pthread_cond_init(&cache->shard[k].done, NULL);
 		}
 	}
 
@@ -140,108 +468,724 @@ cache_t *cache_new(client_t *cl, int n_blk)
 
 void cache_del(cache_t *cache)
 {
+	for (int k = 0; k < cache->n_shard; k++)
+	{
+		pthread_cond_destroy(&cache->shard[k].done);
+		pthread_mutex_destroy(&cache->shard[k].lock);
+		free(cache->shard[k].idx);
+	}
+
+	free(cache->blk);
 	free(cache);
 }
 
-void *cache_get_blk(cache_t *cache, blk_id_t id)
+static void cache_lock_all(cache_t *cache)
 {
-	cblk_t *cblk = cache_find_blk(cache, id);
+	for (int k = 0; k < cache->n_shard; k++)
+	{
+		pthread_mutex_lock(&cache->shard[k].lock);
+	}
+}
 
-	if (cblk != NULL)
+static void cache_unlock_all(cache_t *cache)
+{
+	for (int k = 0; k < cache->n_shard; k++)
 	{
-		return cblk->data;
+		pthread_mutex_unlock(&cache->shard[k].lock);
 	}
+}
 
-	cblk = &cache->blk[id % cache->n_blk];
+int cache_resize(cache_t *cache, int n_blk)
+{
+	cblk_t *	old_blk;
+	int		old_n_blk;
+	int *		old_idx[1 << CACHE_SHARD_BITS];
+	int		used[1 << CACHE_SHARD_BITS]	= { 0 };
+	int		ret				= 0;
 
-	if (cblk_fetch(cblk, id, cache->cl) == 0)
+	if (n_blk < cache->n_shard * CACHE_MIN_BLK)
 	{
-		return cblk->data;
+		n_blk = cache->n_shard * CACHE_MIN_BLK;
 	}
 
-	return NULL;
+	ret = cache_flush(cache);
+
+	if (ret != 0)
+	{
+		return ret;
+	}
+
+	cache_lock_all(cache);
+
+	/*
+	 * Moving the slab would pull pinned blocks out from under their users,
+	 * and a block dirtied since the flush would be lost
+	 */
+	for (int i = 0; i < cache->n_blk; i++)
+	{
+		const cblk_t *cblk = &cache->blk[i];
+
+		if (cblk->pins != 0 || cblk_dirty(cblk) || cblk_wb(cblk))
+		{
+			cache_unlock_all(cache);
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	old_blk = cache->blk;
+	old_n_blk = cache->n_blk;
+
+	for (int k = 0; k < cache->n_shard; k++)
+	{
+		old_idx[k] = cache->shard[k].idx;
+	}
+
+	if (cache_alloc(cache, n_blk) != 0)
+	{
+		cache_unlock_all(cache);
+		return -1;
+	}
+
+	/* Everything is clean now, keep as many resident blocks as fit */
+	for (int i = 0; i < old_n_blk; i++)
+	{
+		cblk_t *	cblk	= &old_blk[i];
+		cache_shard_t *	shard	= cache_shard(cache, cblk->id);
+		int		k	= shard - cache->shard;
+
+		if (cblk_valid(cblk) && used[k] < shard->n_blk)
+		{
+			shard->blk[used[k]] = *cblk;
+			idx_insert(shard, cblk->id, used[k]);
+			used[k]++;
+		}
+	}
+
+	cache_unlock_all(cache);
+
+	free(old_blk);
+
+	for (int k = 0; k < cache->n_shard; k++)
+	{
+		free(old_idx[k]);
+	}
+
+	return 0;
+}
+
+size_t cache_size(const cache_t *cache)
+{
+	return sizeof(cblk_t) * cache->n_blk;
+}
+
+int cache_n_blk(size_t size)
+{
+	size_t n_blk = size / sizeof(cblk_t);
+
+	if (n_blk < CACHE_MIN_BLK)
+	{
+		return CACHE_MIN_BLK;
+	}
+
+	if (n_blk > INT_MAX / 2)
+	{
+		return INT_MAX / 2;
+	}
+
+	return n_blk;
 }
 
-void *cache_claim_blk(cache_t *cache, blk_id_t id)
+/* The block comes back pinned, to be let go with cache_unpin_ptr */
+static cblk_t *cache_get(cache_t *cache, blk_id_t id, int fetch)
 {
-	cblk_t *cblk = cache_find_blk(cache, id);
+	cache_shard_t *	shard	= cache_shard(cache, id);
+	cblk_t *	cblk;
+
+	pthread_mutex_lock(&shard->lock);
+
+	for (;;)
+	{
+		cblk = cache_find_blk(shard, id);
+
+		if (cblk != NULL && cblk_busy(cblk))
+		{
+			pthread_cond_wait(&shard->done, &shard->lock);
+			continue;
+		}
+
+		if (cblk != NULL)
+		{
+			cblk_set_ref(cblk, 1);
+
+			/* A claimed block is about to be overwritten wherever it came from */
+			if (!fetch)
+			{
+				cache_set_dirty(shard, cblk, 1);
+			}
+
+			break;
+		}
+
+		cblk = cache_victim(shard);
+
+		if (cblk == NULL)
+		{
+			break;
+		}
+
+		/* The block may turn up while a dirty victim is written */
+		if (cblk_dirty(cblk))
+		{
+			if (cache_clean(cache, shard, cblk) != 0)
+			{
+				cblk = NULL;
+				break;
+			}
+
+			continue;
+		}
+
+		if (fetch)
+		{
+			if (cache_fetch(cache, shard, cblk, id) != 0)
+			{
+				cblk = NULL;
+			}
+
+			break;
+		}
+
+		cache_bind(shard, cblk, id);
+		cblk->flags = CACHE_VALID;
+		cache_set_dirty(shard, cblk, 1);
+		break;
+	}
 
 	if (cblk != NULL)
 	{
-		return cblk->data;
+		cblk->pins++;
 	}
 
-	cblk = &cache->blk[id % cache->n_blk];
+	pthread_mutex_unlock(&shard->lock);
 
-	cblk_flush(cblk, cache->cl);
+	return cblk;
+}
 
-	cblk->id = id;
-	cblk->flags = CACHE_VALID | CACHE_DIRTY;
+void *cache_pin_blk(cache_t *cache, blk_id_t id)
+{
+	cblk_t *cblk = cache_get(cache, id, 1);
 
-	return cblk->data;
+	return cblk != NULL ? cblk->data : NULL;
 }
 
-void cache_dirty_blk(cache_t *cache, blk_id_t id)
+void *cache_pin_claim(cache_t *cache, blk_id_t id)
 {
-	cblk_t *cblk = cache_find_blk(cache, id);
+	cblk_t *cblk = cache_get(cache, id, 0);
 
-	if (cblk != NULL)
+	return cblk != NULL ? cblk->data : NULL;
+}
+
+void cache_unpin_ptr(cache_t *cache, void *ptr)
+{
+	cache_shard_t *	shard;
+	cblk_t *	cblk	= cache_lock_ptr(cache, ptr, &shard);
+
+	if (cblk == NULL)
+	{
+		return;
+	}
+
+	if (cblk->pins != 0)
 	{
-		cblk_set_dirty(cblk, 1);
+		cblk->pins--;
+
+		if (cblk->pins == 0 && cblk_stale(cblk))
+		{
+			cblk->flags = 0;
+		}
 	}
+
+	pthread_mutex_unlock(&shard->lock);
 }
 
-void cache_dirty_ptr(cache_t *cache, void *ptr)
+/*
+ * Bring in blocks that are about to be wanted, a batch to a round trip.
+ * Blocks already cached are skipped. This is only a hint, so it gives up
+ * quietly when it runs out of slots, and at most half the cache is
+ * replaced so the blocks the caller is working on stay put.
+ */
+void cache_prefetch(cache_t *cache, const blk_id_t *id, int n)
 {
-	cblk_t *cblk = cache_find_ptr(cache, ptr);
+	cblk_t *	cblk[CLIENT_RD_BATCH];
+	blk_t *		blk[CLIENT_RD_BATCH];
+	blk_id_t	want[CLIENT_RD_BATCH];
+	int		ret;
 
-	if (cblk != NULL)
+	if (n > cache->n_blk / 2)
+	{
+		n = cache->n_blk / 2;
+	}
+
+	while (n > 0)
 	{
-		cblk_set_dirty(cblk, 1);
+		int m = 0;
+
+		for (; n > 0 && m < CLIENT_RD_BATCH; id++, n--)
+		{
+			cache_shard_t *	shard	= cache_shard(cache, *id);
+			cblk_t *	c	= NULL;
+			int		stop	= 0;
+
+			pthread_mutex_lock(&shard->lock);
+
+			while (cache_find_blk(shard, *id) == NULL)
+			{
+				c = cache_victim(shard);
+
+				if (c == NULL)
+				{
+					stop = 1;
+					break;
+				}
+
+				if (!cblk_dirty(c))
+				{
+					break;
+				}
+
+				if (cache_clean(cache, shard, c) != 0)
+				{
+					c = NULL;
+					stop = 1;
+					break;
+				}
+
+				c = NULL;
+			}
+
+			if (c != NULL)
+			{
+				cache_bind(shard, c, *id);
+				c->flags = CACHE_BUSY;
+				c->pins++;
+
+				cblk[m] = c;
+				blk[m] = &c->blk;
+				want[m] = *id;
+				m++;
+			}
+
+			pthread_mutex_unlock(&shard->lock);
+
+			if (stop)
+			{
+				n = 0;
+				break;
+			}
+		}
+
+		if (m == 0)
+		{
+			break;
+		}
+
+		ret = client_rd_blks(cache->cl, blk, want, m);
+
+		for (int i = 0; i < m; i++)
+		{
+			cache_shard_t *shard = cache_shard(cache, want[i]);
+
+			pthread_mutex_lock(&shard->lock);
+
+			cblk[i]->pins--;
+
+			if (ret != 0)
+			{
+				idx_remove(shard, want[i]);
+				cblk[i]->flags = 0;
+			}
+			else
+			{
+				cblk[i]->flags = CACHE_VALID | CACHE_REF;
+			}
+
+			pthread_cond_broadcast(&shard->done);
+			pthread_mutex_unlock(&shard->lock);
+		}
+
+		if (ret != 0)
+		{
+			break;
+		}
 	}
 }
 
-int cache_flush_blk(cache_t *cache, blk_id_t id)
+/*
+ * Write-back works on copies of the dirty blocks, taken under the shard lock
+ * and encrypted and sent without it, so the plaintext remains usable. A copy
+ * of a block nobody has pinned cannot be torn, since users change blocks
+ * only while they hold a pin. A pinned block may be halfway through a
+ * change, so it stays dirty and is written again once it settles, and so
+ * does one that was changed again while its copy was on the way.
+ *
+ * The slot is marked under write-back until the server has the copy, so it
+ * is not replaced, and its id not forgotten and reused, in the meantime.
+ */
+
+typedef struct
 {
-	int ret = 0;
+	cblk_t *	cblk;
+	blk_id_t	id;
+	unsigned	gen;
+	int		pinned;
+} cache_wb_t;
 
-	cblk_t *cblk = cache_find_blk(cache, id);
+static void wb_take(cache_wb_t *wb, blk_t *buf, cblk_t *cblk)
+{
+	memcpy(buf, &cblk->blk, sizeof(blk_t));
 
-	if (cblk != NULL)
+	cblk->flags |= CACHE_WB;
+
+	wb->cblk = cblk;
+	wb->id = cblk->id;
+	wb->gen = cblk->gen;
+	wb->pinned = cblk->pins != 0;
+}
+
+static int wb_send(cache_t *cache, blk_t *buf, const cache_wb_t *wb, int n)
+{
+	blk_t *		blk[CACHE_WB_BATCH];
+	blk_id_t	id[CACHE_WB_BATCH];
+	int		ret;
+
+	for (int i = 0; i < n; i++)
+	{
+		blk[i] = &buf[i];
+		id[i] = wb[i].id;
+	}
+
+	ret = client_wr_blks(cache->cl, blk, blk, id, n);
+
+	for (int i = 0; i < n; i++)
 	{
-		ret = cblk_flush(cblk, cache->cl);
+		cache_shard_t *	shard	= cache_shard(cache, wb[i].id);
+		cblk_t *	cblk	= wb[i].cblk;
+
+		pthread_mutex_lock(&shard->lock);
+
+		cblk->flags &= ~CACHE_WB;
+
+		if (	ret == 0		&&
+			!wb[i].pinned		&&
+			cblk->pins == 0		&&
+			cblk->gen == wb[i].gen	)
+		{
+			cache_set_dirty(shard, cblk, 0);
+		}
+
+		pthread_cond_broadcast(&shard->done);
+		pthread_mutex_unlock(&shard->lock);
 	}
 
 	return ret;
 }
 
-int cache_flush_ptr(cache_t *cache, void *ptr)
+/*
+ * Drop a block whose id has been freed, so that a stale copy is never written
+ * over whatever the id is reused for. A pinned block stays readable by those
+ * who hold it, but leaves the index at once so the id is looked up afresh,
+ * and its slot is emptied when the last pin goes.
+ */
+void cache_forget_blk(cache_t *cache, blk_id_t id)
 {
-	int ret = 0;
+	cache_shard_t *	shard	= cache_shard(cache, id);
+	cblk_t *	cblk;
+
+	pthread_mutex_lock(&shard->lock);
 
-	cblk_t *cblk = cache_find_ptr(cache, ptr);
+	cblk = cache_find_blk(shard, id);
+
+	while (cblk != NULL && (cblk_busy(cblk) || cblk_wb(cblk)))
+	{
+		pthread_cond_wait(&shard->done, &shard->lock);
+		cblk = cache_find_blk(shard, id);
+	}
 
 	if (cblk != NULL)
 	{
-		ret = cblk_flush(cblk, cache->cl);
+		cache_set_dirty(shard, cblk, 0);
+		idx_remove(shard, cblk->id);
+
+		if (cblk->pins == 0)
+		{
+			cblk->flags = 0;
+		}
+		else
+		{
+			cblk->flags = CACHE_VALID | CACHE_STALE;
+		}
 	}
 
-	return ret;
+	pthread_mutex_unlock(&shard->lock);
 }
 
-int cache_flush(cache_t *cache)
+void cache_dirty_blk(cache_t *cache, blk_id_t id)
+{
+	cache_shard_t *	shard	= cache_shard(cache, id);
+	cblk_t *	cblk;
+
+	pthread_mutex_lock(&shard->lock);
+
+	cblk = cache_find_blk(shard, id);
+
+	if (cblk != NULL && !cblk_busy(cblk))
+	{
+		cache_set_dirty(shard, cblk, 1);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_dirty_ptr(cache_t *cache, void *ptr)
+{
+	cache_shard_t *	shard;
+	cblk_t *	cblk	= cache_lock_ptr(cache, ptr, &shard);
+
+	if (cblk == NULL)
+	{
+		return;
+	}
+
+	if (!cblk_stale(cblk))
+	{
+		cache_set_dirty(shard, cblk, 1);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+int cache_is_dirty(cache_t *cache, void *ptr)
+{
+	cache_shard_t *	shard;
+	cblk_t *	cblk	= cache_lock_ptr(cache, ptr, &shard);
+	int		dirty;
+
+	if (cblk == NULL)
+	{
+		return 0;
+	}
+
+	dirty = cblk_dirty(cblk);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return dirty;
+}
+
+int cache_n_dirty(cache_t *cache)
+{
+	int n = 0;
+
+	for (int k = 0; k < cache->n_shard; k++)
+	{
+		pthread_mutex_lock(&cache->shard[k].lock);
+		n += cache->shard[k].n_dirty;
+		pthread_mutex_unlock(&cache->shard[k].lock);
+	}
+
+	return n;
+}
+
+/*
+ * Pinned blocks are written back like any other, but stay dirty because
+ * their users may still be changing them. This tells whether any such block
+ * is left, that is, whether a flush would leave the cache clean.
+ */
+int cache_pinned_dirty(cache_t *cache)
 {
 	int ret = 0;
 
-	for (int i = 0; i < cache->n_blk; i++)
+	for (int k = 0; k < cache->n_shard && ret == 0; k++)
 	{
-		ret = cblk_flush(&cache->blk[i], cache->cl);
+		cache_shard_t *shard = &cache->shard[k];
 
-		if (ret != 0)
+		pthread_mutex_lock(&shard->lock);
+
+		for (int i = 0; i < shard->n_blk && shard->n_dirty != 0; i++)
+		{
+			const cblk_t *cblk = &shard->blk[i];
+
+			if (cblk->pins != 0 && cblk_valid(cblk) && cblk_dirty(cblk))
+			{
+				ret = 1;
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return ret;
+}
+
+/*
+ * Write one block through, with the shard locked on entry and unlocked on
+ * return. A write of the block already under way is waited for, since its
+ * copy may be older than what the caller wants on the server.
+ */
+static int cache_flush_one(cache_t *cache, cache_shard_t *shard, blk_id_t id)
+{
+	cache_wb_t	wb;
+	blk_t		buf;
+	cblk_t *	cblk	= cache_find_blk(shard, id);
+
+	while (cblk != NULL && (cblk_busy(cblk) || cblk_wb(cblk)))
+	{
+		pthread_cond_wait(&shard->done, &shard->lock);
+		cblk = cache_find_blk(shard, id);
+	}
+
+	if (cblk == NULL || !cblk_dirty(cblk))
+	{
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+
+	wb_take(&wb, &buf, cblk);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return wb_send(cache, &buf, &wb, 1);
+}
+
+int cache_flush_blk(cache_t *cache, blk_id_t id)
+{
+	cache_shard_t *shard = cache_shard(cache, id);
+
+	pthread_mutex_lock(&shard->lock);
+
+	return cache_flush_one(cache, shard, id);
+}
+
+int cache_flush_ptr(cache_t *cache, void *ptr)
+{
+	cache_shard_t *	shard;
+	cblk_t *	cblk	= cache_lock_ptr(cache, ptr, &shard);
+
+	if (cblk == NULL)
+	{
+		return 0;
+	}
+
+	return cache_flush_one(cache, shard, cblk->id);
+}
+
+/*
+ * Write back every block that has been dirty for at least expire seconds,
+ * then keep going until no more than limit dirty blocks remain, shared out
+ * evenly among the shards. Blocks are sent in batches that share a single
+ * round trip. A block that another thread is writing back is waited for, so
+ * a flush does not return before the server has it.
+ */
+int cache_writeback(cache_t *cache, time_t expire, int limit)
+{
+	int		ret	= 0;
+	time_t		before	= cache_now() - expire;
+	blk_t *		buf	= NULL;
+	cache_wb_t	wb[CACHE_WB_BATCH];
+
+	limit /= cache->n_shard;
+
+	for (int k = 0; k < cache->n_shard && ret == 0; k++)
+	{
+		cache_shard_t *	shard	= &cache->shard[k];
+		int		n	= 0;
+
+		pthread_mutex_lock(&shard->lock);
+
+		for (int pass = 0; pass < 2 && ret == 0; pass++)
 		{
-			return ret;
+			for (int i = 0; i < shard->n_blk && ret == 0; i++)
+			{
+				cblk_t *c = &shard->blk[i];
+
+				if (!cblk_valid(c) || !cblk_dirty(c))
+				{
+					continue;
+				}
+
+				if (pass == 0 && c->dirtied > before)
+				{
+					continue;
+				}
+
+				if (pass == 1 && shard->n_dirty - n <= limit)
+				{
+					break;
+				}
+
+				/* Ours go out first, the other thread may be waiting on them */
+				if (cblk_wb(c))
+				{
+					if (n != 0)
+					{
+						pthread_mutex_unlock(&shard->lock);
+						ret = wb_send(cache, buf, wb, n);
+						pthread_mutex_lock(&shard->lock);
+						n = 0;
+					}
+					else
+					{
+						pthread_cond_wait(&shard->done,
+								&shard->lock);
+					}
+
+					i--;
+					continue;
+				}
+
+				if (buf == NULL)
+				{
+					buf = malloc(sizeof(blk_t) * CACHE_WB_BATCH);
+
+					if (buf == NULL)
+					{
+						ret = -1;
+						break;
+					}
+				}
+
+				wb_take(&wb[n], &buf[n], c);
+				n++;
+
+				if (n == CACHE_WB_BATCH)
+				{
+					pthread_mutex_unlock(&shard->lock);
+					ret = wb_send(cache, buf, wb, n);
+					pthread_mutex_lock(&shard->lock);
+					n = 0;
+				}
+			}
+
+			if (n != 0 && ret == 0)
+			{
+				pthread_mutex_unlock(&shard->lock);
+				ret = wb_send(cache, buf, wb, n);
+				pthread_mutex_lock(&shard->lock);
+				n = 0;
+			}
 		}
+
+		pthread_mutex_unlock(&shard->lock);
 	}
 
+	free(buf);
+
 	return ret;
 }
+
+int cache_flush(cache_t *cache)
+{
+	return cache_writeback(cache, 0, 0);
+}
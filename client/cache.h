@@ -1,10 +1,22 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
 #include <blk.h>
 
 #define CACHE_VALID	1u
 #define CACHE_DIRTY	2u
+#define CACHE_REF	4u
+#define CACHE_BUSY	8u
+#define CACHE_STALE	16u
+#define CACHE_WB	32u
+
+#define CACHE_MIN_BLK	4
+#define CACHE_WB_BATCH	32
+#define CACHE_SHARD_BITS	3
+#define CACHE_SHARD_MIN	64
 
 typedef struct client client_t;
 
@@ -12,24 +24,55 @@ typedef struct
 {
 	blk_id_t	id;
 	unsigned	flags;
-	char		data[BLK_DATA_LEN];
+	unsigned	pins;
+	unsigned	gen;
+	time_t		dirtied;
+	union
+	{
+		blk_t	blk;
+		char	data[BLK_DATA_LEN];
+	};
 } cblk_t;
 
+typedef struct
+{
+	pthread_mutex_t	lock;
+	pthread_cond_t	done;
+	int		n_blk;
+	int		n_dirty;
+	int		hand;
+	unsigned	idx_mask;
+	int *		idx;
+	cblk_t *	blk;
+} cache_shard_t;
+
 typedef struct cache
 {
 	client_t *	cl;
 	int		n_blk;
-	cblk_t		blk[];
+	int		n_shard;
+	cblk_t *	blk;
+	cache_shard_t	shard[1 << CACHE_SHARD_BITS];
 } cache_t;
 
 cache_t *	cache_new	(client_t *cl, int n_blk);
 void		cache_del	(cache_t *cache);
-void *		cache_get_blk	(cache_t *cache, blk_id_t id);
-void *		cache_claim_blk	(cache_t *cache, blk_id_t id);
+int		cache_resize	(cache_t *cache, int n_blk);
+size_t		cache_size	(const cache_t *cache);
+int		cache_n_blk	(size_t size);
+void *		cache_pin_blk	(cache_t *cache, blk_id_t id);
+void *		cache_pin_claim	(cache_t *cache, blk_id_t id);
+void		cache_unpin_ptr	(cache_t *cache, void *ptr);
+void		cache_prefetch	(cache_t *cache, const blk_id_t *id, int n);
+void		cache_forget_blk(cache_t *cache, blk_id_t id);
 void		cache_dirty_blk	(cache_t *cache, blk_id_t id);
 void		cache_dirty_ptr	(cache_t *cache, void *ptr);
+int		cache_is_dirty	(cache_t *cache, void *ptr);
+int		cache_n_dirty	(cache_t *cache);
+int		cache_pinned_dirty(cache_t *cache);
 int		cache_flush_blk	(cache_t *cache, blk_id_t id);
 int		cache_flush_ptr	(cache_t *cache, void *ptr);
+int		cache_writeback	(cache_t *cache, time_t expire, int limit);
 int		cache_flush	(cache_t *cache);
 
 #endif
@@ -7,6 +7,8 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <sodium.h>
 #include <blk.h>
@@ -16,6 +18,7 @@
 #include "cache.h"
 #include "client.h"
 #include "fs.h"
+#include "pcache.h"
 
 static int update_top(client_t *cl, hash_t *hash)
 {
@@ -28,27 +31,43 @@ exit:
 	return ret;
 }
 
+static int read_top(client_t *cl, hash_t *hash)
+{
+	int ret = 0;
+
+	try_fd(0, lseek, cl->hash_fd, 0, SEEK_SET);
+	try_io(0, read, cl->hash_fd, hash, sizeof*(hash));
+
+exit:
+	return ret;
+}
+
 static int verify_top(client_t *cl, hash_t *hash)
 {
 	int	ret = 0;
 	hash_t	buf;
 
-	try_fd(0, lseek, cl->hash_fd, 0, SEEK_SET);
-	try_io(0, read, cl->hash_fd, buf, sizeof(buf));
+	try_fn(0, read_top, cl, &buf);
 	try_fn(0, memcmp, buf, hash, sizeof*(hash));
 
 exit:
 	return ret;
 }
 
-static int compute_top(client_t *cl, blk_t *blk, blk_id_t blk_id, hash_t *hash)
+static void compute_leaf(const blk_t *blk, hash_t *hash)
 {
-	int		ret	= 0;
-	node_id_t	node_id	= mtree_blk_from_depth(MTREE_DEPTH, blk_id);
-
 	crypto_generichash(	(void *)       hash, sizeof*(hash),
 				(const void *) blk , sizeof*(blk) ,
 				NULL               , 0);
+}
+
+static int compute_top(client_t *cl, blk_id_t blk_id, const hash_t *leaf,
+			hash_t *hash)
+{
+	int		ret	= 0;
+	node_id_t	node_id	= mtree_blk_from_depth(MTREE_DEPTH, blk_id);
+
+	memcpy(hash, leaf, sizeof*(hash));
 
 	while (node_id != 0)
 	{
@@ -71,20 +90,110 @@ exit:
 	return ret;
 }
 
+static int decrypt_blk(client_t *cl, blk_t *blk)
+{
+	/* An all-zero block was never written and reads as zeroes */
+	if (sodium_is_zero((void *) blk, sizeof*(blk)))
+	{
+		return 0;
+	}
+
+	return blk_decrypt(	(void *) blk->data,	NULL,
+				NULL,
+				(void *) blk->data,	sizeof(blk->data) +
+							sizeof(blk->auth),
+				NULL, 0,
+				(void *) blk->salt,
+				(void *) cl->key);
+}
+
+/*
+ * Threads share the connection without holding the client lock. A request
+ * is sent whole under io_lock and takes a ticket, and since the server
+ * answers in order, a thread reads its reply once every earlier ticket is
+ * done. Proofs are checked against the top hash in the same order the server
+ * applied the requests.
+ */
+static unsigned long conn_send_begin(client_t *cl)
+{
+	pthread_mutex_lock(&cl->io_lock);
+
+	return cl->io_sent++;
+}
+
+static void conn_send_end(client_t *cl)
+{
+	pthread_mutex_unlock(&cl->io_lock);
+}
+
+static void conn_recv_begin(client_t *cl, unsigned long ticket)
+{
+	pthread_mutex_lock(&cl->io_lock);
+
+	while (cl->io_done != ticket)
+	{
+		pthread_cond_wait(&cl->io_turn, &cl->io_lock);
+	}
+
+	pthread_mutex_unlock(&cl->io_lock);
+}
+
+static void conn_recv_end(client_t *cl)
+{
+	pthread_mutex_lock(&cl->io_lock);
+
+	cl->io_done++;
+	pthread_cond_broadcast(&cl->io_turn);
+
+	pthread_mutex_unlock(&cl->io_lock);
+}
+
 static int client_reset(client_t *cl)
 {
 	cl->sock_fd	= -1;
 	cl->root_fd	= -1;
 	cl->hash_fd	= -1;
+	cl->pc_fd	= -1;
 	cl->sb_cache	= NULL;
 	cl->dir_cache	= NULL;
 	cl->reg_cache	= NULL;
+	cl->fs		= NULL;
+	cl->wb_run	= 0;
+
+	cl->io_sent	= 0;
+	cl->io_done	= 0;
+
+	pthread_mutex_init(&cl->lock, NULL);
+	pthread_mutex_init(&cl->io_lock, NULL);
+	pthread_rwlock_init(&cl->pc_lock, NULL);
+	pthread_cond_init(&cl->io_turn, NULL);
+	pthread_cond_init(&cl->wb_cond, NULL);
 
 	return 0;
 }
 
+static void client_stop_writeback(client_t *cl)
+{
+	int	running;
+
+	client_lock(cl);
+	running		= cl->wb_run;
+	cl->wb_run	= 0;
+	pthread_cond_signal(&cl->wb_cond);
+	client_unlock(cl);
+
+	if (running)
+	{
+		pthread_join(cl->wb_thread, NULL);
+	}
+}
+
 static int client_dstr(client_t *cl)
 {
+	client_stop_writeback(cl);
+
+	fs_unmount(cl);
+
 	if (cl->sb_cache != NULL)
 	{
 		cache_del(cl->sb_cache);
@@ -115,6 +224,17 @@ static int client_dstr(client_t *cl)
 		close(cl->hash_fd);
 	}
 
+	if (cl->pc_fd != -1)
+	{
+		close(cl->pc_fd);
+	}
+
+	pthread_cond_destroy(&cl->wb_cond);
+	pthread_cond_destroy(&cl->io_turn);
+	pthread_rwlock_destroy(&cl->pc_lock);
+	pthread_mutex_destroy(&cl->io_lock);
+	pthread_mutex_destroy(&cl->lock);
+
 	return 0;
 }
 
@@ -137,8 +257,106 @@ exit:
 	return ret;
 }
 
+static int client_open_pcache(client_t *cl)
+{
+	int	ret	= 0;
+	cmd_t	cmd	= CMD_SYNC;
+	hash_t	local;
+	hash_t	remote;
+
+	/* Stored leaves are only good if nobody has moved the tree since */
+	try_fn(0, read_top, cl, &local);
+	try_io(0, send, cl->sock_fd, &cmd, sizeof(cmd), 0);
+	try_io(0, recv, cl->sock_fd, &remote, sizeof(remote), MSG_WAITALL);
+
+	if (memcmp(local, remote, sizeof(local)) == 0)
+	{
+		try_fn(0, pcache_open, cl, &local);
+	}
+	else
+	{
+		try_fn(0, pcache_open, cl, NULL);
+	}
+
+exit:
+	return ret;
+}
+
+static size_t cache_share(const client_opt_t *opt, unsigned share)
+{
+	unsigned total = opt->sb_share + opt->dir_share + opt->reg_share;
+
+	if (total == 0)
+	{
+		return 0;
+	}
+
+	return opt->cache_size / total * share;
+}
+
+static void client_writeback_all(client_t *cl, time_t expire,
+				unsigned pct)
+{
+	cache_t *caches[] = { cl->sb_cache, cl->dir_cache, cl->reg_cache };
+
+	/* Deleting returns before the bitmap is updated, that is done here */
+	if (fs_flush_free(cl) != 0)
+	{
+		log("freeing deleted blocks failed\n");
+	}
+
+	/* Held back timestamps become dirty blocks once they are due */
+	if (fs_flush_times(cl, 0) != 0)
+	{
+		log("writing back timestamps failed\n");
+	}
+
+	for (int i = 0; i < sizeof(caches) / sizeof(*caches); i++)
+	{
+		int limit = caches[i]->n_blk * pct / 100;
+
+		if (cache_writeback(caches[i], expire, limit) != 0)
+		{
+			log("background writeback failed\n");
+		}
+	}
+
+	if (fs_flush_trim(cl) != 0)
+	{
+		log("trimming freed blocks failed\n");
+	}
+}
+
+static void *client_writeback(void *arg)
+{
+	client_t *	cl	= arg;
+	struct timespec	ts;
+
+	client_lock(cl);
+
+	while (cl->wb_run)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += CLIENT_WB_INTERVAL;
+
+		pthread_cond_timedwait(&cl->wb_cond, &cl->lock, &ts);
+
+		/* The caches and the fs have locks of their own */
+		if (cl->wb_run)
+		{
+			client_unlock(cl);
+			client_writeback_all(cl, cl->wb_expire, cl->dirty_bg);
+			client_lock(cl);
+		}
+	}
+
+	client_unlock(cl);
+
+	return NULL;
+}
+
 int client_start(client_t *cl, const char *host, const char *root_path,
-		const char *pw)
+		const char *pw, const client_opt_t *opt)
 {
 	int			ret				= 0;
 	struct protoent *	tcp				= NULL;
@@ -170,9 +388,12 @@ int client_start(client_t *cl, const char *host, const char *root_path,
 
 	randombytes_buf(cl->salt, sizeof(cl->salt));
 
-	cl->sb_cache	= try_ptr(ENOMEM, cache_new, cl, 4);
-	cl->dir_cache	= try_ptr(ENOMEM, cache_new, cl, 4);
-	cl->reg_cache	= try_ptr(ENOMEM, cache_new, cl, 4);
+	cl->sb_cache	= try_ptr(ENOMEM, cache_new, cl,
+				cache_n_blk(cache_share(opt, opt->sb_share)));
+	cl->dir_cache	= try_ptr(ENOMEM, cache_new, cl,
+				cache_n_blk(cache_share(opt, opt->dir_share)));
+	cl->reg_cache	= try_ptr(ENOMEM, cache_new, cl,
+				cache_n_blk(cache_share(opt, opt->reg_share)));
 
 	if (stat(root_path, &statbuf) != 0)
 	{
@@ -190,6 +411,17 @@ int client_start(client_t *cl, const char *host, const char *root_path,
 		cl->hash_fd = try_fd(0, openat, cl->root_fd, "hash", O_RDWR);
 	}
 
+	if (opt->pcache)
+	{
+		try_fn(0, client_open_pcache, cl);
+	}
+
+	try_fn(0, fs_mount, cl);
+
+	cl->wb_expire	= opt->wb_expire;
+	cl->dirty_bg	= opt->dirty_bg;
+	cl->dirty_max	= opt->dirty_max;
+
 exit:
 	if (ret != 0)
 	{
@@ -204,25 +436,72 @@ exit:
 	return ret;
 }
 
+int client_start_writeback(client_t *cl)
+{
+	int ret = 0;
+
+	/* Set before the thread starts, or it may see 0 and return at once */
+	client_lock(cl);
+	cl->wb_run = 1;
+	client_unlock(cl);
+
+	try_fn(0, pthread_create, &cl->wb_thread, NULL, client_writeback, cl);
+
+exit:
+	if (ret != 0)
+	{
+		client_lock(cl);
+		cl->wb_run = 0;
+		client_unlock(cl);
+	}
+
+	return ret;
+}
+
 int client_stop(client_t *cl)
 {
 	int	ret	= 0;
+	hash_t	hash;
+
+	client_stop_writeback(cl);
 
-	ret = client_flush_all(cl);
+	/* Unlinked inodes the kernel never said it forgot are freed here */
+	ret = fs_free_orphans(cl);
+
+	if (client_flush_all(cl) != 0)
+	{
+		ret = -1;
+	}
+
+	if (ret == 0 && cl->pc_fd != -1 && read_top(cl, &hash) == 0)
+	{
+		pcache_close(cl, &hash);
+	}
 
 	client_dstr(cl);
 
 	return ret;
 }
 
-int client_rd_blk(client_t *cl, blk_t *blk, blk_id_t id)
+static int send_rd_blk(client_t *cl, blk_id_t id)
 {
 	int	ret	= 0;
 	cmd_t	cmd	= CMD_RD_BLK;
-	hash_t	hash;
 
 	try_io(0, send, cl->sock_fd, &cmd, sizeof(cmd), MSG_MORE);
 	try_io(0, send, cl->sock_fd, &id, sizeof(id), 0);
+
+exit:
+	return ret;
+}
+
+static int recv_rd_blk(client_t *cl, blk_t *blk, blk_id_t id)
+{
+	int	ret	= 0;
+	cmd_t	cmd;
+	hash_t	leaf;
+	hash_t	hash;
+
 	try_io(0, recv, cl->sock_fd, &cmd, sizeof(cmd), MSG_WAITALL);
 
 	if (cmd == CMD_NDAT)
@@ -238,59 +517,349 @@ int client_rd_blk(client_t *cl, blk_t *blk, blk_id_t id)
 		fail_fn(EINVAL, __func__);
 	}
 
-	try_fn(0, compute_top, cl, blk, id, &hash);
+	compute_leaf(blk, &leaf);
+
+	try_fn(0, compute_top, cl, id, &leaf, &hash);
 	try_fn(0, verify_top, cl, &hash);
 
-	if (cmd == CMD_RD_BLK)
+	pcache_put(cl, blk, &leaf, id);
+
+exit:
+	return ret;
+}
+
+/*
+ * Read up to CLIENT_RD_BATCH blocks for the price of one round trip. Blocks
+ * missing from the persistent cache are asked for back to back under a single
+ * ticket, and the replies are read in the same order.
+ */
+int client_rd_blks(client_t *cl, blk_t **blk, const blk_id_t *id, int n)
+{
+	int		ret		= 0;
+	int		sent[CLIENT_RD_BATCH];
+	int		n_sent		= 0;
+	unsigned long	ticket;
+
+	if (n > CLIENT_RD_BATCH)
 	{
-		ret = blk_decrypt(
-			(void *) blk->data, 	NULL,
-			NULL,
-			(void *) blk->data,	sizeof(blk->data) +
-						sizeof(blk->auth),
-			NULL, 0,
-			(void *) blk->salt,
-			(void *) cl->key);
+		fail_fn(EINVAL, __func__);
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		if (pcache_get(cl, blk[i], id[i]) != 0)
+		{
+			sent[n_sent++] = i;
+		}
+	}
+
+	if (n_sent != 0)
+	{
+		ticket = conn_send_begin(cl);
+
+		for (int i = 0; i < n_sent && ret == 0; i++)
+		{
+			ret = send_rd_blk(cl, id[sent[i]]);
+		}
+
+		conn_send_end(cl);
+
+		conn_recv_begin(cl, ticket);
+
+		for (int i = 0; i < n_sent && ret == 0; i++)
+		{
+			ret = recv_rd_blk(cl, blk[sent[i]], id[sent[i]]);
+		}
+
+		conn_recv_end(cl);
+	}
+
+	/* Decryption needs nothing shared and runs alongside other requests */
+	for (int i = 0; i < n && ret == 0; i++)
+	{
+		ret = decrypt_blk(cl, blk[i]);
 	}
 
 exit:
 	return ret;
 }
 
-int client_wr_blk(client_t *cl, blk_t *blk, blk_id_t id)
+int client_rd_blk(client_t *cl, blk_t *blk, blk_id_t id)
+{
+	return client_rd_blks(cl, &blk, &id, 1);
+}
+
+int client_wr_blk(client_t *cl, blk_t *blk, blk_t *enc, blk_id_t id)
+{
+	return client_wr_blks(cl, &blk, &enc, &id, 1);
+}
+
+static int send_wr_blks(client_t *cl, blk_t **enc, const blk_id_t *id, int n)
 {
 	int	ret	= 0;
 	cmd_t	cmd	= CMD_WR_BLK;
+
+	for (int i = 0; i < n; i++)
+	{
+		int flags = (i + 1 == n ? 0 : MSG_MORE);
+
+		try_io(0, send, cl->sock_fd, &cmd, sizeof(cmd), MSG_MORE);
+		try_io(0, send, cl->sock_fd, &id[i], sizeof(id[i]), MSG_MORE);
+		try_io(0, send, cl->sock_fd, enc[i], sizeof*(enc[i]), flags);
+	}
+
+exit:
+	return ret;
+}
+
+static int recv_wr_blks(client_t *cl, blk_t **enc, const blk_id_t *id, int n)
+{
+	int	ret	= 0;
+	hash_t	leaf;
 	hash_t	hash;
 
+	/* The server applies the writes in order, each proof builds on the last */
+	for (int i = 0; i < n; i++)
+	{
+		compute_leaf(enc[i], &leaf);
+
+		try_fn(0, compute_top, cl, id[i], &leaf, &hash);
+		try_fn(0, update_top, cl, &hash);
+
+		pcache_put(cl, enc[i], &leaf, id[i]);
+	}
+
+exit:
+	return ret;
+}
+
+/*
+ * Encrypt each blk[i] into enc[i] and send it. The two may be the same
+ * block, in which case the plaintext is restored if the write fails.
+ */
+int client_wr_blks(client_t *cl, blk_t **blk, blk_t **enc,
+			const blk_id_t *id, int n)
+{
+	int		ret;
+	unsigned long	ticket;
+
+	for (int i = 0; i < n; i++)
+	{
+		memcpy(enc[i]->salt, cl->salt, sizeof(cl->salt));
+
+		blk_encrypt(	(void *) enc[i]->data, NULL,
+				(void *) blk[i]->data, sizeof(blk[i]->data),
+				NULL, 0,
+				NULL,
+				(void *) enc[i]->salt,
+				(void *) cl->key);
+	}
+
+	ticket = conn_send_begin(cl);
+	ret = send_wr_blks(cl, enc, id, n);
+	conn_send_end(cl);
+
+	conn_recv_begin(cl, ticket);
+
+	if (ret == 0)
+	{
+		ret = recv_wr_blks(cl, enc, id, n);
+	}
+
+	conn_recv_end(cl);
+
+	if (ret != 0)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			if (blk[i] == enc[i])
+			{
+				decrypt_blk(cl, blk[i]);
+			}
+		}
+	}
+
+	return ret;
+}
+
+static int send_trim(client_t *cl, blk_id_t id, blk_id_t count)
+{
+	int	ret	= 0;
+	cmd_t	cmd	= CMD_TRIM;
+
 	try_io(0, send, cl->sock_fd, &cmd, sizeof(cmd), MSG_MORE);
 	try_io(0, send, cl->sock_fd, &id, sizeof(id), MSG_MORE);
+	try_io(0, send, cl->sock_fd, &count, sizeof(count), 0);
 
-	memcpy(blk->salt, cl->salt, sizeof(cl->salt));
+exit:
+	return ret;
+}
 
-	blk_encrypt(	(void *) blk->data, NULL,
-			(void *) blk->data, sizeof(blk->data),
-			NULL, 0,
-			NULL,
-			(void *) blk->salt,
-			(void *) cl->key);
+static int recv_trim(client_t *cl, blk_id_t id, blk_id_t count)
+{
+	static blk_t	null_blk;
+	int		ret	= 0;
+	hash_t		leaf;
+	hash_t		hash;
 
-	try_io(0, send, cl->sock_fd, blk, sizeof*(blk), 0);
+	compute_leaf(&null_blk, &leaf);
 
-	try_fn(0, compute_top, cl, blk, id, &hash);
-	try_fn(0, update_top, cl, &hash);
+	for (blk_id_t i = id; i != id + count; i++)
+	{
+		try_fn(0, compute_top, cl, i, &leaf, &hash);
+		try_fn(0, update_top, cl, &hash);
+	}
+
+	pcache_trim(cl, id, count);
+
+exit:
+	return ret;
+}
+
+/*
+ * Tell the server that n ranges of blocks are free, so it can drop their
+ * data. They read as never written afterwards.
+ */
+int client_trim_blks(client_t *cl, const blk_id_t *id, const blk_id_t *count,
+			int n)
+{
+	int		ret	= 0;
+	unsigned long	ticket;
+
+	ticket = conn_send_begin(cl);
+
+	for (int i = 0; i < n && ret == 0; i++)
+	{
+		ret = send_trim(cl, id[i], count[i]);
+	}
+
+	conn_send_end(cl);
+
+	conn_recv_begin(cl, ticket);
+
+	for (int i = 0; i < n && ret == 0; i++)
+	{
+		ret = recv_trim(cl, id[i], count[i]);
+	}
+
+	conn_recv_end(cl);
+
+	return ret;
+}
+
+static int send_cp_blk(client_t *cl, blk_id_t src, blk_id_t dst)
+{
+	int	ret	= 0;
+	cmd_t	cmd	= CMD_CP_BLK;
+
+	try_io(0, send, cl->sock_fd, &cmd, sizeof(cmd), MSG_MORE);
+	try_io(0, send, cl->sock_fd, &src, sizeof(src), MSG_MORE);
+	try_io(0, send, cl->sock_fd, &dst, sizeof(dst), 0);
+
+exit:
+	return ret;
+}
+
+static int recv_cp_blk(client_t *cl, blk_id_t src, blk_id_t dst)
+{
+	int	ret	= 0;
+	hash_t	leaf;
+	hash_t	old_top;
+	hash_t	new_top;
+
+	try_io(0, recv, cl->sock_fd, leaf, sizeof(leaf), MSG_WAITALL);
+	try_fn(0, compute_top, cl, src, &leaf, &old_top);
+	try_fn(0, compute_top, cl, dst, &leaf, &new_top);
+
+	/* The copy is only as good as the source, which must check out first */
+	try_fn(0, verify_top, cl, &old_top);
+	try_fn(0, update_top, cl, &new_top);
+
+	pcache_trim(cl, dst, 1);
+
+exit:
+	return ret;
+}
+
+/*
+ * Have the server copy n blocks from src[i] to dst[i] without them passing
+ * through the client. The copies are made in order.
+ */
+int client_cp_blks(client_t *cl, const blk_id_t *src, const blk_id_t *dst,
+			int n)
+{
+	int		ret	= 0;
+	unsigned long	ticket;
+
+	ticket = conn_send_begin(cl);
+
+	for (int i = 0; i < n && ret == 0; i++)
+	{
+		ret = send_cp_blk(cl, src[i], dst[i]);
+	}
+
+	conn_send_end(cl);
+
+	conn_recv_begin(cl, ticket);
+
+	for (int i = 0; i < n && ret == 0; i++)
+	{
+		ret = recv_cp_blk(cl, src[i], dst[i]);
+	}
+
+	conn_recv_end(cl);
+
+	return ret;
+}
+
+int client_throttle(client_t *cl)
+{
+	int		ret		= 0;
+	cache_t *	caches[]	= { cl->sb_cache, cl->dir_cache,
+					    cl->reg_cache };
+
+	for (int i = 0; i < sizeof(caches) / sizeof(*caches); i++)
+	{
+		cache_t *	cache	= caches[i];
+		int		n_dirty	= cache_n_dirty(cache);
+
+		/* Past the hard limit the writer pays for the write-back itself */
+		if (n_dirty * 100 > cache->n_blk * cl->dirty_max)
+		{
+			int limit = cache->n_blk * cl->dirty_bg / 100;
+
+			try_fn(0, cache_writeback, cache, 0, limit);
+		}
+		else if (n_dirty * 100 > cache->n_blk * cl->dirty_bg)
+		{
+			pthread_cond_signal(&cl->wb_cond);
+		}
+	}
 
 exit:
 	return ret;
 }
 
+void client_lock(client_t *cl)
+{
+	pthread_mutex_lock(&cl->lock);
+}
+
+void client_unlock(client_t *cl)
+{
+	pthread_mutex_unlock(&cl->lock);
+}
+
 int client_flush_all(client_t *cl)
 {
 	int ret = 0;
 
+	try_fn(0, fs_flush_free, cl);
+	try_fn(0, fs_flush_times, cl, 1);
 	try_fn(0, cache_flush, cl->sb_cache);
 	try_fn(0, cache_flush, cl->dir_cache);
 	try_fn(0, cache_flush, cl->reg_cache);
+	try_fn(0, fs_flush_trim, cl);
 
 exit:
 	return ret;
@@ -1,29 +1,74 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <pthread.h>
+#include <time.h>
 #include <blk.h>
 
-#define KEY_LEN	blk_crypto(_KEYBYTES)
+#define KEY_LEN			blk_crypto(_KEYBYTES)
+#define CLIENT_WB_INTERVAL	1
+#define CLIENT_RD_BATCH		32
 
 typedef struct cache cache_t;
+typedef struct fs_info fs_info_t;
+
+typedef struct
+{
+	int			pcache;
+	size_t			cache_size;
+	unsigned		sb_share;
+	unsigned		dir_share;
+	unsigned		reg_share;
+	time_t			wb_expire;
+	unsigned		dirty_bg;
+	unsigned		dirty_max;
+} client_opt_t;
 
 typedef struct client
 {
 	int			sock_fd;
 	int			root_fd;
 	int			hash_fd;
+	int			pc_fd;
 	char			key[KEY_LEN];
 	char			salt[BLK_SALT_LEN];
 	cache_t *		sb_cache;
 	cache_t *		dir_cache;
 	cache_t *		reg_cache;
+	fs_info_t *		fs;
+	pthread_mutex_t		lock;
+	pthread_mutex_t		io_lock;
+	pthread_rwlock_t	pc_lock;
+	pthread_cond_t		io_turn;
+	unsigned long		io_sent;
+	unsigned long		io_done;
+	pthread_cond_t		wb_cond;
+	pthread_t		wb_thread;
+	int			wb_run;
+	time_t			wb_expire;
+	unsigned		dirty_bg;
+	unsigned		dirty_max;
 } client_t;
 
 int	client_start		(client_t *cl, const char *host,
-				const char *root_path, const char *pw);
+				const char *root_path, const char *pw,
+				const client_opt_t *opt);
+int	client_start_writeback	(client_t *cl);
 int	client_stop		(client_t *cl);
+void	client_lock		(client_t *cl);
+void	client_unlock		(client_t *cl);
 int	client_rd_blk		(client_t *cl, blk_t *blk, blk_id_t id);
-int	client_wr_blk		(client_t *cl, blk_t *blk, blk_id_t id);
+int	client_rd_blks		(client_t *cl, blk_t **blk, const blk_id_t *id,
+				int n);
+int	client_wr_blk		(client_t *cl, blk_t *blk, blk_t *enc,
+				blk_id_t id);
+int	client_wr_blks		(client_t *cl, blk_t **blk, blk_t **enc,
+				const blk_id_t *id, int n);
+int	client_trim_blks	(client_t *cl, const blk_id_t *id,
+				const blk_id_t *count, int n);
+int	client_cp_blks		(client_t *cl, const blk_id_t *src,
+				const blk_id_t *dst, int n);
+int	client_throttle		(client_t *cl);
 int	client_flush_all	(client_t *cl);
 
 #endif
@@ -0,0 +1,197 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dcache.h"
+
+/*
+ * The dentry cache maps a (parent directory, name) pair to the entry it
+ * names, or records that no such entry exists. It is set associative: a pair
+ * hashes to one set of DCACHE_WAYS slots, and a full set gives up a slot
+ * with the CLOCK policy used by the block caches.
+ *
+ * The fs layer keeps it coherent by adding or negating the pair whenever it
+ * adds or removes a directory entry, and by dropping every pair under a
+ * directory when that directory is freed, since its block id may be reused.
+ * Lookups from parallel requests are serialised by a mutex of its own, which
+ * is never held across anything else.
+ */
+
+static unsigned dcache_hash(unsigned parent, const char *name, size_t name_len)
+{
+	uint64_t hash = 0xcbf29ce484222325 ^ parent;
+
+	for (size_t i = 0; i < name_len; i++)
+	{
+		hash ^= (unsigned char) name[i];
+		hash *= 0x100000001b3;
+	}
+
+	return (hash >> 32 ^ hash) % DCACHE_SETS;
+}
+
+static dentry_t *dcache_find(dcache_t *dc, unsigned parent,
+				const char *name, size_t name_len)
+{
+	dentry_t *set = &dc->ent[dcache_hash(parent, name, name_len) *
+				DCACHE_WAYS];
+
+	for (int i = 0; i < DCACHE_WAYS; i++)
+	{
+		dentry_t *de = &set[i];
+
+		if (	de->state != DCACHE_MISS		&&
+			de->parent == parent			&&
+			memcmp(de->name, name, name_len) == 0	&&
+			de->name[name_len] == '\0'		)
+		{
+			return de;
+		}
+	}
+
+	return NULL;
+}
+
+static dentry_t *dcache_slot(dcache_t *dc, unsigned parent,
+				const char *name, size_t name_len)
+{
+	unsigned	set_id	= dcache_hash(parent, name, name_len);
+	dentry_t *	set	= &dc->ent[set_id * DCACHE_WAYS];
+	dentry_t *	de	= dcache_find(dc, parent, name, name_len);
+
+	if (de != NULL)
+	{
+		return de;
+	}
+
+	for (int i = 0; i < DCACHE_WAYS; i++)
+	{
+		if (set[i].state == DCACHE_MISS)
+		{
+			return &set[i];
+		}
+	}
+
+	for (;;)
+	{
+		de = &set[dc->hand[set_id]];
+		dc->hand[set_id] = (dc->hand[set_id] + 1) % DCACHE_WAYS;
+
+		if (!de->ref)
+		{
+			return de;
+		}
+
+		de->ref = 0;
+	}
+}
+
+static void dcache_set(dcache_t *dc, unsigned parent, const char *name,
+			size_t name_len, unsigned id, unsigned type,
+			unsigned state)
+{
+	dentry_t *de;
+
+	/* Longer names can not exist, and fail the lookup cheaply anyway */
+	if (name_len >= DCACHE_NAME_LEN)
+	{
+		return;
+	}
+
+	de = dcache_slot(dc, parent, name, name_len);
+
+	de->parent = parent;
+	de->id = id;
+	de->type = type;
+	de->state = state;
+	de->ref = 0;
+	memset(de->name, 0, sizeof(de->name));
+	memcpy(de->name, name, name_len);
+}
+
+dcache_t *dcache_new(void)
+{
+	dcache_t *dc = malloc(sizeof(dcache_t));
+
+	if (dc != NULL)
+	{
+		pthread_mutex_init(&dc->lock, NULL);
+		dc->ent = calloc(DCACHE_SETS * DCACHE_WAYS, sizeof(dentry_t));
+		dc->hand = calloc(DCACHE_SETS, sizeof(*dc->hand));
+
+		if (dc->ent == NULL || dc->hand == NULL)
+		{
+			dcache_del(dc);
+			return NULL;
+		}
+	}
+
+	return dc;
+}
+
+void dcache_del(dcache_t *dc)
+{
+	pthread_mutex_destroy(&dc->lock);
+	free(dc->ent);
+	free(dc->hand);
+	free(dc);
+}
+
+int dcache_lookup(dcache_t *dc, unsigned parent, const char *name,
+			size_t name_len, unsigned *id, unsigned *type)
+{
+	dentry_t *de;
+	int state = DCACHE_MISS;
+
+	if (name_len >= DCACHE_NAME_LEN)
+	{
+		return DCACHE_MISS;
+	}
+
+	pthread_mutex_lock(&dc->lock);
+
+	de = dcache_find(dc, parent, name, name_len);
+
+	if (de != NULL)
+	{
+		de->ref = 1;
+		*id = de->id;
+		*type = de->type;
+		state = de->state;
+	}
+
+	pthread_mutex_unlock(&dc->lock);
+
+	return state;
+}
+
+void dcache_add(dcache_t *dc, unsigned parent, const char *name,
+		size_t name_len, unsigned id, unsigned type)
+{
+	pthread_mutex_lock(&dc->lock);
+	dcache_set(dc, parent, name, name_len, id, type, DCACHE_HIT);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_add_neg(dcache_t *dc, unsigned parent, const char *name,
+			size_t name_len)
+{
+	pthread_mutex_lock(&dc->lock);
+	dcache_set(dc, parent, name, name_len, 0, 0, DCACHE_NEG);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_forget_dir(dcache_t *dc, unsigned parent)
+{
+	pthread_mutex_lock(&dc->lock);
+
+	for (int i = 0; i < DCACHE_SETS * DCACHE_WAYS; i++)
+	{
+		if (dc->ent[i].parent == parent)
+		{
+			dc->ent[i].state = DCACHE_MISS;
+		}
+	}
+
+	pthread_mutex_unlock(&dc->lock);
+}
@@ -0,0 +1,42 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define DCACHE_NAME_LEN	16
+#define DCACHE_WAYS	4
+#define DCACHE_SETS	1024
+
+enum dcache_state { DCACHE_MISS, DCACHE_HIT, DCACHE_NEG, };
+
+typedef struct
+{
+	unsigned	parent;
+	unsigned	id;
+	unsigned char	type;
+	unsigned char	state;
+	unsigned char	ref;
+	char		name[DCACHE_NAME_LEN];
+} dentry_t;
+
+typedef struct dcache
+{
+	pthread_mutex_t	lock;
+	dentry_t *	ent;
+	unsigned char *	hand;
+} dcache_t;
+
+dcache_t *	dcache_new		(void);
+void		dcache_del		(dcache_t *dc);
+int		dcache_lookup		(dcache_t *dc, unsigned parent,
+					const char *name, size_t name_len,
+					unsigned *id, unsigned *type);
+void		dcache_add		(dcache_t *dc, unsigned parent,
+					const char *name, size_t name_len,
+					unsigned id, unsigned type);
+void		dcache_add_neg		(dcache_t *dc, unsigned parent,
+					const char *name, size_t name_len);
+void		dcache_forget_dir	(dcache_t *dc, unsigned parent);
+
+#endif
@@ -1,5 +1,8 @@
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <mtree.h>
 #include "cache.h"
 #include "client.h"
 #include "err.h"
@@ -16,530 +19,3252 @@
         __ptr;\
     })
 
-static unsigned block_alloc(client_t *cl)
+#define verify_id(id)\
+    ({\
+        unsigned __id = id;\
+        if (__id == 0) return -FSERR_IO;\
+        __id;\
+    })
+
+#define MAP_BITS (BLOCK_SIZE * 8)
+
+#define LOCK_FREE UINT_MAX
+
+#define COPY_CHUNK (16 * BLOCK_SIZE)
+
+// Operations run in parallel, and each locks the inodes it works on by id for
+// as long as it works on them. Locks are taken directories before their
+// children; a rename across directories first takes rename_lock, under which
+// it may take two unrelated directories in id order. The allocator has a
+// mutex of its own, taken after any inode. fs->lock only guards the tables in
+// fs_info_t and is never held across a cache access, and the dentry cache
+// and the block caches lock themselves.
+//
+// A cache block may be replaced by another thread at any time unless it is
+// pinned, so every block is pinned for as long as a pointer to it is used.
+static void lock_block(client_t *cl, unsigned id)
 {
-    fs_super_t *super = verify_ptr(cache_get_blk(cl->sb_cache, SUPER_ID));
+    fs_info_t *fs = cl->fs;
 
-    unsigned map_count = super->map_count;
-    unsigned map_id    = 1;
-    unsigned char *map = verify_ptr(cache_get_blk(cl->sb_cache, map_id));
+    pthread_mutex_lock(&fs->lock);
 
-    for (unsigned byte_id = map_count / 8 + 1; byte_id < BLOCK_SIZE * map_count; byte_id++)
+    for (;;)
     {
-        map_id = byte_id / BLOCK_SIZE;
-        if (byte_id % BLOCK_SIZE == 0)
+        int held = 0;
+        int slot = -1;
+
+        for (int i = 0; i < FS_LOCK_SLOTS; i++)
         {
-            map = verify_ptr(cache_get_blk(cl->sb_cache, map_id));
+            if (fs->locked[i] == id) held = 1;
+            if (fs->locked[i] == LOCK_FREE && slot < 0) slot = i;
         }
 
-        unsigned char *byte = &map[byte_id % BLOCK_SIZE];
-        if (*byte == 0xFF) continue;
-
-        for (unsigned offset = 0; offset < 8; offset++)
+        if (!held && slot >= 0)
         {
-            if (!((*byte >> offset) & 1))
-            {
-                *byte |= (1 << offset);
-                cache_dirty_blk(cl->sb_cache, map_id);
-                return byte_id * 8 + offset;
-            }
+            fs->locked[slot] = id;
+            break;
         }
+
+        pthread_cond_wait(&fs->unlocked, &fs->lock);
     }
 
-    return 0;
+    pthread_mutex_unlock(&fs->lock);
 }
 
-static int block_free(client_t *cl, unsigned id)
+static void unlock_block(client_t *cl, unsigned id)
 {
-    unsigned byte_id     = id / 8;
-    unsigned byte_offset = id % 8;
-    unsigned map_id      = 1 + byte_id / BLOCK_SIZE;
-    unsigned map_offset  = byte_id % BLOCK_SIZE;
+    fs_info_t *fs = cl->fs;
 
-    unsigned char *map = verify_ptr(cache_get_blk(cl->sb_cache, map_id));
+    pthread_mutex_lock(&fs->lock);
 
-    map[map_offset] &= ~(1 << byte_offset);
-    cache_dirty_blk(cl->sb_cache, map_id);
+    for (int i = 0; i < FS_LOCK_SLOTS; i++)
+    {
+        if (fs->locked[i] == id)
+        {
+            fs->locked[i] = LOCK_FREE;
+            break;
+        }
+    }
 
-    return 0;
+    pthread_cond_broadcast(&fs->unlocked);
+    pthread_mutex_unlock(&fs->lock);
 }
 
-int fs_init(client_t *cl, unsigned map_count)
+// Two inodes that are not parent and child, in id order
+static void lock_pair(client_t *cl, unsigned a, unsigned b)
 {
-    fs_super_t *super = verify_ptr(cache_claim_blk(cl->sb_cache, SUPER_ID));
-
-    super->total_count = map_count * BLOCK_SIZE * 8;
-    super->free_count  = super->total_count;
-    super->map_count   = map_count;
-
-    unsigned root_id = block_alloc(cl);
-    fs_dir_t *root   = verify_ptr(cache_claim_blk(cl->dir_cache, root_id));
+    lock_block(cl, a < b ? a : b);
+    if (a != b) lock_block(cl, a < b ? b : a);
+}
 
-    memset(root, 0, BLOCK_SIZE);
+static void unlock_pair(client_t *cl, unsigned a, unsigned b)
+{
+    if (a != b) unlock_block(cl, a < b ? b : a);
+    unlock_block(cl, a < b ? a : b);
+}
 
-    root->entry_count = 0;
-    super->root = root_id;
+// Blocks taken again before the server was told they were free must keep
+// their data
+static void trim_forget(fs_info_t *fs, unsigned start, unsigned len)
+{
+    for (unsigned id = start; fs->trim_count != 0 && id < start + len; id++)
+    {
+        if (fs->trim_map[id / 8] & (1 << (id % 8)))
+        {
+            fs->trim_map[id / 8] &= ~(1 << (id % 8));
+            fs->trim_count--;
+        }
+    }
+}
 
-    timespec_get(&root->acc, TIME_UTC);
-    timespec_get(&root->mod, TIME_UTC);
+// The runs are only put together when they are sent, so none is ever lost
+// to a full list
+static void trim_add(fs_info_t *fs, unsigned id)
+{
+    if (fs->trim_map[id / 8] & (1 << (id % 8))) return;
 
-    cache_dirty_blk(cl->sb_cache, SUPER_ID);
-    cache_dirty_blk(cl->dir_cache, root_id);
+    fs->trim_map[id / 8] |= 1 << (id % 8);
+    fs->trim_count++;
+}
 
-    return 0;
+static int map_test(const unsigned char *map, unsigned id)
+{
+    return (map[id % MAP_BITS / 8] >> (id % 8)) & 1;
 }
 
-static int parse_name(const char **begin, const char **path)
+// Take up to want free blocks in a row from start, without leaving its bitmap
+// block, and return how many were taken. The allocator lock is held.
+static unsigned claim_run(client_t *cl, unsigned char *map, unsigned start, unsigned want)
 {
-    while (**path == '/') (*path)++;
-    if (**path == '\0') return 0;
+    fs_info_t *fs = cl->fs;
 
-    *begin = *path;
+    unsigned map_idx = start / MAP_BITS;
+    unsigned end     = (map_idx + 1) * MAP_BITS;
+    if (end > fs->total_count) end = fs->total_count;
 
-    while (**path != '/')
+    unsigned len = 0;
+    while (len < want && start + len < end && !map_test(map, start + len))
     {
-        if (**path == '\0')
-        {
-            return 1;
-        }
-        (*path)++;
+        unsigned id = start + len;
+        map[id % MAP_BITS / 8] |= (1 << (id % 8));
+        len++;
     }
 
-    return 1;
+    cache_dirty_ptr(cl->sb_cache, map);
+    trim_forget(fs, start, len);
+
+    fs->map_free[map_idx] -= len;
+    fs->free_count        -= len;
+    fs->cursor = start + len < fs->total_count ? start + len : fs->first;
+
+    fs_super_t *super = cache_pin_blk(cl->sb_cache, SUPER_ID);
+    if (super != NULL)
+    {
+        super->free_count = fs->free_count;
+        cache_dirty_ptr(cl->sb_cache, super);
+        cache_unpin_ptr(cl->sb_cache, super);
+    }
+
+    return len;
 }
 
-int fs_find_block(client_t *cl, unsigned root, const char *path, unsigned *id, unsigned *type)
+// Runs of up to want blocks are allocated at goal when it is free, and
+// otherwise next-fit from a cursor that wraps around the volume. The free
+// count of every bitmap block is kept in memory, so full bitmap blocks are
+// skipped without being fetched.
+static unsigned alloc_run(client_t *cl, unsigned goal, unsigned want, unsigned *len)
 {
-    fs_super_t *super = verify_ptr(cache_get_blk(cl->sb_cache, SUPER_ID));
-    *id = super->root;
-    *type = FS_DIR;
-    fs_dir_t *dir = verify_ptr(cache_get_blk(cl->dir_cache, *id));
+    fs_info_t *fs = cl->fs;
+    unsigned char *map;
 
-    const char *begin = path;
+    *len = 0;
 
-    for (;;)
+    if (fs->free_count == 0) return 0;
+
+    if (goal >= fs->first && goal < fs->total_count && fs->map_free[goal / MAP_BITS] != 0)
     {
-        if (!parse_name(&begin, &path)) break;
+        map = cache_pin_blk(cl->sb_cache, 1 + goal / MAP_BITS);
+        if (map == NULL) return 0;
 
-        unsigned name_len = path - begin;
-        int matched = 0;
+        if (!map_test(map, goal)) *len = claim_run(cl, map, goal, want);
 
-        for (unsigned i = 0; i < DIR_MAX_ENTRIES; i++)
-        {
-            fs_dir_entry_t *entry = &dir->entries[i];
+        cache_unpin_ptr(cl->sb_cache, map);
+
+        if (*len != 0) return goal;
+    }
+
+    unsigned id = fs->cursor;
 
-            if (!entry->used) continue;
+    for (unsigned n = 0; n <= fs->map_count; n++)
+    {
+        unsigned map_idx = id / MAP_BITS;
+        unsigned end     = (map_idx + 1) * MAP_BITS;
+        if (end > fs->total_count) end = fs->total_count;
 
-            unsigned entry_name_len = strlen(entry->name);
+        if (fs->map_free[map_idx] != 0)
+        {
+            map = cache_pin_blk(cl->sb_cache, 1 + map_idx);
+            if (map == NULL) return 0;
 
-            if (entry_name_len == name_len && memcmp(entry->name, begin, name_len) == 0)
+            while (id < end)
             {
-                *id = entry->id;
-                *type = entry->type;
-                if (*type == FS_FILE)
+                if (map[id % MAP_BITS / 8] == 0xFF)
+                {
+                    id = (id | 7) + 1;
+                    continue;
+                }
+
+                if (!map_test(map, id))
                 {
-                    return 0;
+                    *len = claim_run(cl, map, id, want);
+                    cache_unpin_ptr(cl->sb_cache, map);
+                    return id;
                 }
-                dir = verify_ptr(cache_get_blk(cl->dir_cache, *id));
-                matched = 1;
-                break;
+
+                id++;
             }
+
+            cache_unpin_ptr(cl->sb_cache, map);
         }
 
-        if (!matched) return -FSERR_NOT_FOUND;
+        id = end < fs->total_count ? end : fs->first;
     }
 
     return 0;
 }
 
-int fs_create_dir(client_t *cl, unsigned parent, const char *name, unsigned *id)
+static int id_cmp(const void *a, const void *b)
 {
-    fs_super_t *super_ptr = verify_ptr(cache_get_blk(cl->sb_cache, SUPER_ID));
+    unsigned x = *(const unsigned *) a;
+    unsigned y = *(const unsigned *) b;
 
-    unsigned name_len = strlen(name) + 1; // include \0
+    return x < y ? -1 : x > y;
+}
 
-    if (name_len > NAME_MAX_LEN) return -FSERR_LONG_NAME;
-    if (super_ptr->free_count == 0) return -FSERR_OOM;
+// Clear the bits of the blocks waiting to be freed. Sorted, they fall into
+// groups by bitmap block, so a large delete fetches each bitmap block once
+// rather than cycling the few the superblock cache holds. The caller holds
+// the allocator lock.
+static int apply_frees(client_t *cl)
+{
+    fs_info_t *fs = cl->fs;
+    unsigned n = fs->defer_count;
+    unsigned done = 0;
+    int ret = 0;
 
-    fs_dir_t *dir_ptr = verify_ptr(cache_get_blk(cl->dir_cache, parent));
-    if (dir_ptr->entry_count == DIR_MAX_ENTRIES) return -FSERR_FULL_DIR;
+    if (n == 0) return 0;
 
-    for (unsigned i = 0; i <= dir_ptr->entry_count; i++)
+    qsort(fs->defer, n, sizeof(unsigned), id_cmp);
+
+    while (done < n)
     {
-        fs_dir_entry_t *entry = &dir_ptr->entries[i];
-        if (!entry->used)
+        unsigned map_idx = fs->defer[done] / MAP_BITS;
+        unsigned char *map = cache_pin_blk(cl->sb_cache, 1 + map_idx);
+
+        if (map == NULL)
         {
-            unsigned did = block_alloc(cl);
-            if (did == 0) return -FSERR_OOM;
+            ret = -FSERR_IO;
+            break;
+        }
 
-            fs_dir_t *this_dir = verify_ptr(cache_claim_blk(cl->dir_cache, did));
+        for (; done < n && fs->defer[done] / MAP_BITS == map_idx; done++)
+        {
+            unsigned id = fs->defer[done];
+            if (!map_test(map, id)) continue;
 
-            memset(this_dir, 0, sizeof*(this_dir));
-            this_dir->parent      = parent;
-            this_dir->entry_id    = i;
-            this_dir->entry_count = 2;
+            map[id % MAP_BITS / 8] &= ~(1 << (id % 8));
+            trim_add(fs, id);
 
-            // add . and .. entries
-            this_dir->entries[0].used = 1;
-            this_dir->entries[0].type = FS_DIR;
-            memcpy(this_dir->entries[0].name, ".", 2);
-            this_dir->entries[0].id = did;
+            fs->map_free[map_idx]++;
+            fs->free_count++;
+        }
 
-            this_dir->entries[1].used = 1;
-            this_dir->entries[1].type = FS_DIR;
-            memcpy(this_dir->entries[1].name, "..", 3);
-            this_dir->entries[1].id = parent;
+        cache_dirty_ptr(cl->sb_cache, map);
+        cache_unpin_ptr(cl->sb_cache, map);
+    }
 
-            entry->id   = did;
-            entry->type = FS_DIR;
-            entry->used = 1;
+    // what could not be applied waits for the next pass
+    memmove(fs->defer, fs->defer + done, (n - done) * sizeof(unsigned));
+    fs->defer_count = n - done;
 
-            memcpy(entry->name, name, name_len);
+    fs_super_t *super = cache_pin_blk(cl->sb_cache, SUPER_ID);
+    if (super == NULL) return -FSERR_IO;
 
-            dir_ptr->entry_count++;
+    super->free_count = fs->free_count;
+    cache_dirty_ptr(cl->sb_cache, super);
+    cache_unpin_ptr(cl->sb_cache, super);
 
-            *id = did;
-            cache_dirty_blk(cl->dir_cache, did);
-            cache_dirty_blk(cl->dir_cache, parent);
+    return ret;
+}
 
-            return 0;
-        }
+static unsigned block_alloc_run(client_t *cl, unsigned goal, unsigned want, unsigned *len)
+{
+    pthread_mutex_lock(&cl->fs->alloc_lock);
+
+    unsigned id = alloc_run(cl, goal, want, len);
+
+    // blocks waiting to be freed are taken back before giving up
+    if (*len == 0 && cl->fs->defer_count != 0 && apply_frees(cl) == 0)
+    {
+        id = alloc_run(cl, goal, want, len);
     }
 
-    return 0;
+    pthread_mutex_unlock(&cl->fs->alloc_lock);
+
+    return id;
 }
 
-int fs_create_file(client_t *cl, unsigned dir, const char *name, unsigned *id)
+static unsigned block_alloc(client_t *cl)
 {
-    fs_super_t *super_ptr = verify_ptr(cache_get_blk(cl->sb_cache, SUPER_ID));
-
-    unsigned name_len = strlen(name) + 1; // include \0
+    unsigned len;
 
-    if (name_len > NAME_MAX_LEN) return -FSERR_LONG_NAME;
-    if (super_ptr->free_count == 0) return -FSERR_OOM;
+    return block_alloc_run(cl, 0, 1, &len);
+}
 
-    fs_dir_t *dir_ptr = verify_ptr(cache_get_blk(cl->dir_cache, dir));
-    if (dir_ptr->entry_count == DIR_MAX_ENTRIES) return -FSERR_FULL_DIR;
+static void lazy_forget(fs_info_t *fs, unsigned id)
+{
+    pthread_mutex_lock(&fs->lock);
 
-    for (unsigned i = 0; i <= dir_ptr->entry_count; i++)
+    for (unsigned i = 0; fs->lazy_count != 0 && i < FS_LAZY_SLOTS; i++)
     {
-        fs_dir_entry_t *entry = &dir_ptr->entries[i];
-        if (!entry->used)
+        if (fs->lazy[i].id == id)
         {
-            unsigned fid = block_alloc(cl);
-            if (fid == 0) return -FSERR_OOM;
+            fs->lazy[i].id = 0;
+            fs->lazy_count--;
+        }
+    }
+
+    pthread_mutex_unlock(&fs->lock);
+}
+
+static int free_pending(const fs_info_t *fs, unsigned id)
+{
+    for (unsigned i = 0; i < fs->defer_count; i++)
+    {
+        if (fs->defer[i] == id) return 1;
+    }
+
+    return 0;
+}
 
-            fs_file_t *file = verify_ptr(cache_claim_blk(cl->dir_cache, fid));
+// The id stays taken in the bitmap until the free is applied, so it cannot be
+// handed out again while it is still listed
+static int block_free(client_t *cl, unsigned id)
+{
+    fs_info_t *fs = cl->fs;
 
-            file->size        = 0;
-            file->block_count = 0;
-            file->parent      = dir;
-            file->entry_id    = i;
+    if (id < fs->first || id >= fs->total_count) return -FSERR_IO;
 
-            entry->id = fid;
-            entry->type = FS_FILE;
-            entry->used = 1;
-            memcpy(entry->name, name, name_len);
+    pthread_mutex_lock(&fs->alloc_lock);
 
-            dir_ptr->entry_count++;
+    // the id may come back as either metadata or data
+    cache_forget_blk(cl->dir_cache, id);
+    cache_forget_blk(cl->reg_cache, id);
+    lazy_forget(fs, id);
 
-            *id = fid;
-            cache_dirty_blk(cl->dir_cache, dir);
-            cache_dirty_blk(cl->dir_cache, fid);
+    if (fs->defer_count == FS_FREE_SLOTS) apply_frees(cl);
 
-            return 0;
-        }
+    int ret = -FSERR_IO;
+
+    if (fs->defer_count < FS_FREE_SLOTS)
+    {
+        fs->defer[fs->defer_count++] = id;
+        ret = 0;
     }
 
-    return 0;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return ret;
 }
 
-int fs_delete_file(client_t *cl, unsigned id)
+int fs_flush_free(client_t *cl)
 {
-    fs_file_t *file_ptr = verify_ptr(cache_get_blk(cl->dir_cache, id));
+    pthread_mutex_lock(&cl->fs->alloc_lock);
 
-    for (unsigned i = 0; i < file_ptr->block_count; i++)
-    {
-        if (block_free(cl, file_ptr->blocks[id]) != 0) return FSERR_IO;
-    }
+    int ret = apply_frees(cl);
 
-    fs_dir_t *parent = verify_ptr(cache_get_blk(cl->dir_cache, file_ptr->parent));
-    parent->entries[file_ptr->entry_id].used = 0;
-    parent->entry_count--;
+    pthread_mutex_unlock(&cl->fs->alloc_lock);
 
-    cache_dirty_blk(cl->dir_cache, file_ptr->parent);
+    return ret;
+}
 
-    if (block_free(cl, id) != 0) return FSERR_IO;
+// Blocks below the first data block hold the superblock and the bitmap. The
+// volume never extends past what the server's Merkle tree can address.
+static unsigned first_block(unsigned map_count)
+{
+    return (map_count / 8 + 1) * 8;
+}
 
-    return 0;
+static unsigned total_blocks(unsigned map_count)
+{
+    unsigned total = map_count * MAP_BITS;
+    unsigned limit = mtree_nblk_from_depth(MTREE_DEPTH);
+
+    return total < limit ? total : limit;
 }
 
-int fs_delete_dir(client_t *cl, unsigned id)
+static int init_super(client_t *cl, fs_super_t *super, unsigned map_count)
 {
-    fs_dir_t *dir = verify_ptr(cache_get_blk(cl->dir_cache, id));
+    unsigned first = first_block(map_count);
+
+    super->total_count = total_blocks(map_count);
+    super->free_count  = super->total_count - first - 1;
+    super->map_count   = map_count;
+
+    // the root directory takes the first data block
+    unsigned root_id = first;
 
-    // start from 2 because '.' & '..'
-    for (int i = 2; i < DIR_MAX_ENTRIES; i++)
+    for (unsigned i = 0; i < map_count; i++)
     {
-        fs_dir_entry_t *entry = &dir->entries[i];
-        if (entry->used)
+        unsigned char *map = verify_ptr(cache_pin_claim(cl->sb_cache, 1 + i));
+        memset(map, 0, BLOCK_SIZE);
+
+        if (i == 0)
         {
-            switch (entry->type)
-            {
-                case FS_FILE:
-                    fs_delete_file(cl, entry->id);
-                    break;
-                case FS_DIR:
-                    fs_delete_dir(cl, entry->id);
-                    break;
-                default:
-                    break;
-            }
+            memset(map, 0xFF, first / 8);
+            map[root_id / 8] |= 1 << (root_id % 8);
         }
+
+        cache_unpin_ptr(cl->sb_cache, map);
     }
-    if (block_free(cl, id) != 0) return -FSERR_IO;
 
-    fs_dir_t *parent = verify_ptr(cache_get_blk(cl->dir_cache, dir->parent));
-    parent->entries[dir->entry_id].used = 0;
-    parent->entry_count--;
+    fs_dir_t *root = verify_ptr(cache_pin_claim(cl->dir_cache, root_id));
 
-    cache_dirty_blk(cl->dir_cache, dir->parent);
+    memset(root, 0, BLOCK_SIZE);
+
+    root->type   = FS_DIR;
+    root->parent = root_id;
+    super->root = root_id;
+
+    timespec_get(&root->acc, TIME_UTC);
+    timespec_get(&root->mod, TIME_UTC);
+
+    cache_dirty_ptr(cl->sb_cache, super);
+    cache_unpin_ptr(cl->dir_cache, root);
 
     return 0;
 }
 
-int fs_write_file(client_t *cl, unsigned file, const char *buf, size_t size, size_t offset, size_t *bytes_written)
+int fs_init(client_t *cl, unsigned map_count)
 {
-    unsigned char *block;
-    unsigned block_id;
-
-    fs_file_t *fptr = verify_ptr(cache_get_blk(cl->dir_cache, file));
-    *bytes_written = 0;
+    fs_super_t *super = verify_ptr(cache_pin_claim(cl->sb_cache, SUPER_ID));
 
-    if (size == 0) return 0;
+    int ret = init_super(cl, super, map_count);
 
-    cache_dirty_blk(cl->dir_cache, file);
+    cache_unpin_ptr(cl->sb_cache, super);
 
-    unsigned stop_pos     = size + offset;
-    unsigned start_offset = offset % BLOCK_SIZE;
-    unsigned first_block  = offset / BLOCK_SIZE;
-    unsigned stop_offset;
-    unsigned last_block;
+    return ret;
+}
 
-    if (stop_pos % BLOCK_SIZE == 0)
-    {
-        stop_offset = BLOCK_SIZE;
-        last_block  = stop_pos / BLOCK_SIZE - 1;
-    }
-    else
+static int count_free(client_t *cl, fs_info_t *fs)
+{
+    for (unsigned i = 0; i < fs->map_count; i++)
     {
-        stop_offset = stop_pos % BLOCK_SIZE;
-        last_block  = stop_pos / BLOCK_SIZE;
-    }
+        unsigned begin = i * MAP_BITS;
+        unsigned end   = begin + MAP_BITS;
+        if (begin < fs->first)     begin = fs->first;
+        if (end > fs->total_count) end   = fs->total_count;
 
-    if (last_block >= fptr->block_count)
-    {
-        for (unsigned i = fptr->block_count; i <= last_block; i++)
+        fs->map_free[i] = 0;
+        if (begin >= end) continue;
+
+        unsigned char *map = verify_ptr(cache_pin_blk(cl->sb_cache, 1 + i));
+
+        for (unsigned id = begin; id < end; id++)
         {
-            block_id = block_alloc(cl);
-            if (block_id == 0) return -FSERR_OOM;
-            fptr->blocks[i] = block_id;
-            fptr->block_count++;
+            if (!map_test(map, id)) fs->map_free[i]++;
         }
+
+        cache_unpin_ptr(cl->sb_cache, map);
+
+        fs->free_count += fs->map_free[i];
     }
 
-    if (first_block == last_block)
+    return 0;
+}
+
+int fs_mount(client_t *cl)
+{
+    fs_super_t *super = verify_ptr(cache_pin_blk(cl->sb_cache, SUPER_ID));
+
+    fs_info_t *fs = malloc(sizeof(fs_info_t));
+    if (fs == NULL)
     {
-        block_id = fptr->blocks[first_block];
-        block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-        memcpy(block + start_offset, buf + *bytes_written, stop_offset - start_offset);
-        cache_dirty_blk(cl->reg_cache, block_id);
-        *bytes_written += stop_offset - start_offset;
-        if (offset + *bytes_written > fptr->size) fptr->size = offset + *bytes_written;
-        return 0;
+        cache_unpin_ptr(cl->sb_cache, super);
+        return -FSERR_OOM;
     }
 
-    block_id = fptr->blocks[first_block];
-    block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-    memcpy(block + start_offset, buf + *bytes_written, BLOCK_SIZE - start_offset);
-    cache_dirty_blk(cl->reg_cache, block_id);
-    *bytes_written += BLOCK_SIZE - start_offset;
-    if (offset + *bytes_written > fptr->size) fptr->size = offset + *bytes_written;
+    fs->first       = first_block(super->map_count);
+    fs->total_count = total_blocks(super->map_count);
+    fs->root        = super->root;
+    fs->free_count  = 0;
+    fs->cursor      = fs->first;
+    fs->map_count   = (fs->total_count + MAP_BITS - 1) / MAP_BITS;
+    fs->map_free    = calloc(fs->map_count, sizeof(unsigned));
+    fs->trim_map    = calloc((fs->total_count + 7) / 8, 1);
+    fs->refs        = calloc(FS_REF_MIN, sizeof(fs_ref_t));
+    fs->ref_mask    = FS_REF_MIN - 1;
+    fs->ref_count   = 0;
+    fs->dcache      = dcache_new();
+
+    for (int i = 0; i < FS_LOCK_SLOTS; i++) fs->locked[i] = LOCK_FREE;
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->unlocked, NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->rename_lock, NULL);
+
+    fs->atime       = FS_ATIME_RELATIME;
+    fs->lazy_expire = 0;
+    fs->lazy_count  = 0;
+    memset(fs->lazy, 0, sizeof(fs->lazy));
+    fs->trim_count  = 0;
+    fs->defer_count = 0;
+    fs->mapped      = 0;
+
+    if (fs->map_free == NULL || fs->trim_map == NULL || fs->refs == NULL || fs->dcache == NULL || count_free(cl, fs) != 0)
+    {
+        cache_unpin_ptr(cl->sb_cache, super);
+        if (fs->dcache != NULL) dcache_del(fs->dcache);
+        pthread_mutex_destroy(&fs->rename_lock);
+        pthread_mutex_destroy(&fs->alloc_lock);
+        pthread_cond_destroy(&fs->unlocked);
+        pthread_mutex_destroy(&fs->lock);
+        free(fs->map_free);
+        free(fs->trim_map);
+        free(fs->refs);
+        free(fs);
+        return -FSERR_IO;
+    }
 
-    for (unsigned i = first_block + 1; i < last_block; i++)
+    // older volumes never kept the count up to date
+    if (super->free_count != fs->free_count || super->total_count != fs->total_count)
     {
-        block_id = fptr->blocks[i];
-        block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-        memcpy(block, buf + *bytes_written, BLOCK_SIZE);
-        cache_dirty_blk(cl->reg_cache, block_id);
-        *bytes_written += BLOCK_SIZE;
-        if (offset + *bytes_written > fptr->size) fptr->size = offset + *bytes_written;
+        super->free_count  = fs->free_count;
+        super->total_count = fs->total_count;
+        cache_dirty_ptr(cl->sb_cache, super);
     }
 
-    block_id = fptr->blocks[last_block];
-    block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-    memcpy(block, buf + *bytes_written, stop_offset);
-    cache_dirty_blk(cl->reg_cache, block_id);
-    *bytes_written += stop_offset;
-    if (offset + *bytes_written > fptr->size) fptr->size = offset + *bytes_written;
+    cache_unpin_ptr(cl->sb_cache, super);
+
+    cl->fs = fs;
 
     return 0;
 }
 
-int fs_read_file(client_t *cl, unsigned file, char *buf, size_t size, size_t offset, size_t *bytes_read)
+void fs_unmount(client_t *cl)
 {
-    unsigned char *block;
-    unsigned block_id;
+    if (cl->fs == NULL) return;
+
+    dcache_del(cl->fs->dcache);
+    pthread_mutex_destroy(&cl->fs->rename_lock);
+    pthread_mutex_destroy(&cl->fs->alloc_lock);
+    pthread_cond_destroy(&cl->fs->unlocked);
+    pthread_mutex_destroy(&cl->fs->lock);
+    free(cl->fs->map_free);
+    free(cl->fs->trim_map);
+    free(cl->fs->refs);
+    free(cl->fs);
+    cl->fs = NULL;
+}
 
-    fs_file_t *fptr = verify_ptr(cache_get_blk(cl->dir_cache, file));
-    *bytes_read = 0;
+int fs_get_usage(client_t *cl, unsigned *total, unsigned *free_count)
+{
+    pthread_mutex_lock(&cl->fs->alloc_lock);
 
-    if (size == 0) return 0;
-    if (offset >= fptr->size) return 0;
+    *total      = cl->fs->total_count - cl->fs->first;
+    *free_count = cl->fs->free_count + cl->fs->defer_count;
 
-    unsigned stop_pos     = size + offset;
-    if (stop_pos > fptr->size) stop_pos = fptr->size;
-    unsigned start_offset = offset % BLOCK_SIZE;
-    unsigned first_block  = offset / BLOCK_SIZE;
-    unsigned stop_offset;
-    unsigned last_block;
+    pthread_mutex_unlock(&cl->fs->alloc_lock);
 
-    if (stop_pos % BLOCK_SIZE == 0)
-    {
-        stop_offset = BLOCK_SIZE;
-        last_block  = stop_pos / BLOCK_SIZE - 1;
-    }
-    else
+    return 0;
+}
+
+static int parse_name(const char **begin, const char **path)
+{
+    while (**path == '/') (*path)++;
+    if (**path == '\0') return 0;
+
+    *begin = *path;
+
+    while (**path != '/')
     {
-        stop_offset = stop_pos % BLOCK_SIZE;
-        last_block  = stop_pos / BLOCK_SIZE;
+        if (**path == '\0')
+        {
+            return 1;
+        }
+        (*path)++;
     }
 
-    if (first_block >= fptr->block_count) return 0;
+    return 1;
+}
+
+// Directory entries are hashed by name (FNV-1a). The top table_bits bits of
+// the hash pick a bucket and the hash also orders entries for readdir, so a
+// cookie stays valid across inserts, removes and bucket splits.
+static uint64_t name_hash(const char *name, unsigned name_len)
+{
+    uint64_t hash = 0xcbf29ce484222325;
 
-    if (first_block == last_block)
+    for (unsigned i = 0; i < name_len; i++)
     {
-        block_id = fptr->blocks[first_block];
-        block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-        memcpy(buf + *bytes_read, block + start_offset, stop_offset - start_offset);
-        *bytes_read += stop_offset - start_offset;
-        return 0;
+        hash ^= (unsigned char) name[i];
+        hash *= 0x100000001b3;
     }
 
-    block_id = fptr->blocks[first_block];
-    block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-    memcpy(buf + *bytes_read, block + start_offset, BLOCK_SIZE - start_offset);
-    *bytes_read += BLOCK_SIZE - start_offset;
+    return hash;
+}
+
+// Cookies 1 and 2 are taken by '.' and '..'
+static uint64_t hash_cookie(uint64_t hash)
+{
+    return (hash >> 2) + 3;
+}
+
+static unsigned hash_slot(uint64_t hash, unsigned bits)
+{
+    return bits == 0 ? 0 : hash >> (64 - bits);
+}
+
+static unsigned *dir_table(fs_dir_t *dir)
+{
+    return (unsigned *) dir->entries;
+}
+
+static fs_dir_entry_t *entry_find(fs_dir_entry_t *entries, unsigned count, const char *name, unsigned name_len)
+{
+    if (name_len >= NAME_MAX_LEN) return NULL;
 
-    for (unsigned i = first_block + 1; i < last_block; i++)
+    for (unsigned i = 0; i < count; i++)
     {
-        block_id = fptr->blocks[i];
-        block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-        memcpy(buf + *bytes_read, block, BLOCK_SIZE);
-        *bytes_read += BLOCK_SIZE;
-    }
+        fs_dir_entry_t *entry = &entries[i];
 
-    block_id = fptr->blocks[last_block];
-    block = verify_ptr(cache_get_blk(cl->reg_cache, block_id));
-    memcpy(buf + *bytes_read, block, stop_offset);
-    *bytes_read += stop_offset;
+        if (memcmp(entry->name, name, name_len) == 0 && entry->name[name_len] == '\0') return entry;
+    }
 
-    return 0;
+    return NULL;
 }
 
-int fs_truncate_file(client_t *cl, unsigned id, unsigned size)
+// Find an entry by name and copy it out. bucket_id is set to the bucket
+// holding the entry, or 0 if it is inline.
+static int dir_find(client_t *cl, fs_dir_t *dir, const char *name, unsigned name_len, fs_dir_entry_t *found, unsigned *bucket_id)
 {
-    fs_file_t *fptr = verify_ptr(cache_get_blk(cl->dir_cache, id));
+    fs_dir_entry_t *entry;
 
-    unsigned new_block_count;
-    unsigned block_id;
+    *bucket_id = 0;
 
-    if (size % BLOCK_SIZE == 0)
+    if (!dir->hashed)
     {
-        new_block_count = size / BLOCK_SIZE;
+        entry = entry_find(dir->entries, dir->entry_count, name, name_len);
+        if (entry != NULL) *found = *entry;
     }
     else
     {
-        new_block_count = size / BLOCK_SIZE + 1;
+        uint64_t hash = name_hash(name, name_len);
+        *bucket_id = dir_table(dir)[hash_slot(hash, dir->table_bits)];
+
+        fs_bucket_t *bucket = verify_ptr(cache_pin_blk(cl->dir_cache, *bucket_id));
+        entry = entry_find(bucket->entries, bucket->count, name, name_len);
+        if (entry != NULL) *found = *entry;
+        cache_unpin_ptr(cl->dir_cache, bucket);
     }
 
-    if (fptr->block_count < new_block_count)
+    return entry != NULL ? 0 : -FSERR_NOT_FOUND;
+}
+
+// Point an existing entry at another inode
+static int dir_set_id(client_t *cl, fs_dir_t *dir, const char *name, unsigned name_len, unsigned id)
+{
+    fs_dir_entry_t *entry;
+
+    if (!dir->hashed)
     {
-        for (unsigned i = fptr->block_count; i < new_block_count; i++)
-        {
-            block_id = block_alloc(cl);
-            if (block_id == 0) return -FSERR_OOM;
-            fptr->blocks[i] = block_id;
-        }
+        entry = entry_find(dir->entries, dir->entry_count, name, name_len);
+        if (entry == NULL) return -FSERR_NOT_FOUND;
+
+        entry->id = id;
+        cache_dirty_ptr(cl->dir_cache, dir);
+
+        return 0;
     }
-    else
-    if (fptr->block_count > new_block_count)
+
+    uint64_t hash = name_hash(name, name_len);
+    unsigned bucket_id = dir_table(dir)[hash_slot(hash, dir->table_bits)];
+
+    fs_bucket_t *bucket = verify_ptr(cache_pin_blk(cl->dir_cache, bucket_id));
+    entry = entry_find(bucket->entries, bucket->count, name, name_len);
+    if (entry != NULL)
     {
-        for (unsigned i = new_block_count; i < fptr->block_count; i++)
-        {
-            unsigned ret = block_free(cl, fptr->blocks[i]);
-            if (ret != 0) return ret;
-        }
+        entry->id = id;
+        cache_dirty_ptr(cl->dir_cache, bucket);
     }
+    cache_unpin_ptr(cl->dir_cache, bucket);
 
-    fptr->size = size;
-    fptr->block_count = new_block_count;
-
-    return 0;
+    return entry != NULL ? 0 : -FSERR_NOT_FOUND;
 }
 
-unsigned fs_get_root(client_t *cl)
+static unsigned bucket_alloc(client_t *cl, unsigned depth)
 {
-    fs_super_t *super = cache_get_blk(cl->sb_cache, SUPER_ID);
-    if (super == NULL) return 0;
-    return super->root;
+    unsigned id = block_alloc(cl);
+    if (id == 0) return 0;
+
+    fs_bucket_t *bucket = cache_pin_claim(cl->dir_cache, id);
+    if (bucket == NULL)
+    {
+        block_free(cl, id);
+        return 0;
+    }
+
+    bucket->depth = depth;
+    bucket->count = 0;
+    cache_dirty_ptr(cl->dir_cache, bucket);
+    cache_unpin_ptr(cl->dir_cache, bucket);
+
+    return id;
 }
 
-int fs_get_file_size(client_t *cl, unsigned id, unsigned *size)
+// Move the inline entries out into a single bucket
+static int dir_make_hashed(client_t *cl, fs_dir_t *dir)
 {
-    fs_file_t *file = verify_ptr(cache_get_blk(cl->dir_cache, id));
-    *size = file->size;
+    unsigned id = bucket_alloc(cl, 0);
+    if (id == 0) return -FSERR_OOM;
+
+    fs_bucket_t *bucket = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    memcpy(bucket->entries, dir->entries, dir->entry_count * sizeof(fs_dir_entry_t));
+    bucket->count = dir->entry_count;
+    cache_dirty_ptr(cl->dir_cache, bucket);
+    cache_unpin_ptr(cl->dir_cache, bucket);
+
+    dir->hashed        = 1;
+    dir->table_bits    = 0;
+    dir_table(dir)[0]  = id;
+
     return 0;
 }
 
-static int fs_dump_dir(client_t *cl, unsigned dir, unsigned idt)
+static int split_bucket(client_t *cl, fs_dir_t *dir, unsigned id, fs_bucket_t *old)
 {
-    fs_dir_t *dir_ptr = verify_ptr(cache_get_blk(cl->dir_cache, dir));
+    unsigned *table = dir_table(dir);
 
-    for (unsigned i = 0; i < DIR_MAX_ENTRIES; i++)
+    if (old->depth == dir->table_bits)
     {
-        fs_dir_entry_t *entry = &dir_ptr->entries[i];
+        if ((2u << dir->table_bits) > DIR_TABLE_MAX) return -FSERR_FULL_DIR;
 
-        if (entry->used) {
-            indent(idt);
-            printf("%s, block=%d, type=%s\n",
-                entry->name,
-                entry->id,
-                entry->type == FS_DIR ? "dir" : "file");
-            if (entry->type == FS_FILE)
-            {
-                fs_file_t *file_ptr = verify_ptr(cache_get_blk(cl->dir_cache, entry->id));
-                for (unsigned j = 0; j < file_ptr->block_count; j++)
-                {
-                    indent(idt + 1);
-                    printf("%d: %d\n", j, file_ptr->blocks[j]);
-                }
+        // double the table in place, back to front
+        for (unsigned i = 1u << dir->table_bits; i-- > 0;)
+        {
+            table[2 * i + 1] = table[i];
+            table[2 * i]     = table[i];
+        }
+        dir->table_bits++;
+    }
+
+    unsigned new_id = bucket_alloc(cl, old->depth + 1);
+    if (new_id == 0) return -FSERR_OOM;
+
+    fs_bucket_t *new = verify_ptr(cache_pin_blk(cl->dir_cache, new_id));
+
+    old->depth++;
+
+    // the next hash bit down decides which half an entry goes to
+    unsigned kept = 0;
+    for (unsigned i = 0; i < old->count; i++)
+    {
+        fs_dir_entry_t *entry = &old->entries[i];
+        uint64_t hash = name_hash(entry->name, strlen(entry->name));
+
+        if ((hash >> (64 - old->depth)) & 1)
+            new->entries[new->count++] = *entry;
+        else
+            old->entries[kept++] = *entry;
+    }
+    old->count = kept;
+
+    unsigned shift = dir->table_bits - old->depth;
+    for (unsigned i = 0; i < 1u << dir->table_bits; i++)
+    {
+        if (table[i] == id && ((i >> shift) & 1)) table[i] = new_id;
+    }
+
+    cache_dirty_ptr(cl->dir_cache, new);
+    cache_unpin_ptr(cl->dir_cache, new);
+    cache_dirty_ptr(cl->dir_cache, old);
+
+    return 0;
+}
+
+static int dir_insert(client_t *cl, fs_dir_t *dir, const fs_dir_entry_t *entry)
+{
+    if (!dir->hashed)
+    {
+        if (dir->entry_count < DIR_INLINE_ENTRIES)
+        {
+            dir->entries[dir->entry_count++] = *entry;
+            return 0;
+        }
+
+        int ret = dir_make_hashed(cl, dir);
+        if (ret != 0) return ret;
+    }
+
+    uint64_t hash = name_hash(entry->name, strlen(entry->name));
+
+    for (;;)
+    {
+        unsigned id = dir_table(dir)[hash_slot(hash, dir->table_bits)];
+        fs_bucket_t *bucket = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+        if (bucket->count < BUCKET_MAX_ENTRIES)
+        {
+            bucket->entries[bucket->count++] = *entry;
+            dir->entry_count++;
+
+            cache_dirty_ptr(cl->dir_cache, bucket);
+            cache_unpin_ptr(cl->dir_cache, bucket);
+
+            return 0;
+        }
+
+        int ret = split_bucket(cl, dir, id, bucket);
+
+        cache_unpin_ptr(cl->dir_cache, bucket);
+
+        if (ret != 0) return ret;
+    }
+}
+
+// Entries are unordered, so the last one fills the gap
+static int dir_remove(client_t *cl, fs_dir_t *dir, const char *name, unsigned name_len)
+{
+    fs_dir_entry_t *entry;
+
+    if (!dir->hashed)
+    {
+        entry = entry_find(dir->entries, dir->entry_count, name, name_len);
+        if (entry == NULL) return -FSERR_NOT_FOUND;
+
+        *entry = dir->entries[--dir->entry_count];
+
+        return 0;
+    }
+
+    uint64_t hash = name_hash(name, name_len);
+    unsigned bucket_id = dir_table(dir)[hash_slot(hash, dir->table_bits)];
+
+    fs_bucket_t *bucket = verify_ptr(cache_pin_blk(cl->dir_cache, bucket_id));
+    entry = entry_find(bucket->entries, bucket->count, name, name_len);
+    if (entry != NULL)
+    {
+        *entry = bucket->entries[--bucket->count];
+        dir->entry_count--;
+        cache_dirty_ptr(cl->dir_cache, bucket);
+    }
+    cache_unpin_ptr(cl->dir_cache, bucket);
+
+    return entry != NULL ? 0 : -FSERR_NOT_FOUND;
+}
+
+typedef struct {
+    uint64_t       cookie;
+    fs_dir_entry_t entry;
+} cookie_entry_t;
+
+static int cookie_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const cookie_entry_t *) a)->cookie;
+    uint64_t y = ((const cookie_entry_t *) b)->cookie;
+
+    return x < y ? -1 : x > y;
+}
+
+// The entries are copied out first, so fn is free to use the caches
+static int walk_entries(const fs_dir_entry_t *entries, unsigned count, uint64_t after, fs_dir_filler_t fn, void *ctx)
+{
+    cookie_entry_t sorted[BUCKET_MAX_ENTRIES > DIR_INLINE_ENTRIES ? BUCKET_MAX_ENTRIES : DIR_INLINE_ENTRIES];
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        uint64_t cookie = hash_cookie(name_hash(entries[i].name, strlen(entries[i].name)));
+
+        if (cookie <= after) continue;
+
+        sorted[n].cookie = cookie;
+        sorted[n].entry  = entries[i];
+        n++;
+    }
+
+    qsort(sorted, n, sizeof(sorted[0]), cookie_cmp);
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        int ret = fn(ctx, &sorted[i].entry, sorted[i].cookie);
+        if (ret != 0) return ret;
+    }
+
+    return 0;
+}
+
+// Walk the entries with a cookie past after. dir must be pinned.
+static int dir_walk(client_t *cl, fs_dir_t *dir, uint64_t after, fs_dir_filler_t fn, void *ctx)
+{
+    if (!dir->hashed) return walk_entries(dir->entries, dir->entry_count, after, fn, ctx);
+
+    unsigned *table = dir_table(dir);
+    unsigned slot = after < 3 ? 0 : hash_slot((after - 3) << 2, dir->table_bits);
+
+    while (slot < 1u << dir->table_bits)
+    {
+        fs_bucket_t *bucket = verify_ptr(cache_pin_blk(cl->dir_cache, table[slot]));
+
+        // a bucket covers an aligned run of slots
+        unsigned span = 1u << (dir->table_bits - bucket->depth);
+
+        int ret = walk_entries(bucket->entries, bucket->count, after, fn, ctx);
+        cache_unpin_ptr(cl->dir_cache, bucket);
+        if (ret != 0) return ret;
+
+        slot = (slot / span + 1) * span;
+    }
+
+    return 0;
+}
+
+static int free_buckets(client_t *cl, fs_dir_t *dir)
+{
+    unsigned *table = dir_table(dir);
+    unsigned slot = 0;
+
+    while (slot < 1u << dir->table_bits)
+    {
+        unsigned id = table[slot];
+        fs_bucket_t *bucket = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+        unsigned span = 1u << (dir->table_bits - bucket->depth);
+        cache_unpin_ptr(cl->dir_cache, bucket);
+
+        int ret = block_free(cl, id);
+        if (ret != 0) return ret;
+
+        slot = (slot / span + 1) * span;
+    }
+
+    return 0;
+}
+
+static int read_dir(client_t *cl, unsigned id, fs_dir_t *dir, uint64_t offset, fs_dir_filler_t fn, void *ctx)
+{
+    fs_dir_entry_t dot = { FS_DIR, ".", id };
+    fs_dir_entry_t dotdot = { FS_DIR, "..", dir->parent };
+
+    int ret = 0;
+
+    if (offset < 1) ret = fn(ctx, &dot, 1);
+    if (ret == 0 && offset < 2) ret = fn(ctx, &dotdot, 2);
+    if (ret == 0) ret = dir_walk(cl, dir, offset, fn, ctx);
+
+    return ret < 0 ? ret : 0;
+}
+
+int fs_read_dir(client_t *cl, unsigned dir, uint64_t offset, fs_dir_filler_t fn, void *ctx)
+{
+    fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, dir));
+
+    lock_block(cl, dir);
+
+    int ret = read_dir(cl, dir, dir_ptr, offset, fn, ctx);
+
+    unlock_block(cl, dir);
+
+    cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+    return ret;
+}
+
+// Resolve one path component, through the dentry cache when possible
+static int lookup(client_t *cl, unsigned dir, const char *name, unsigned name_len, unsigned *id, unsigned *type)
+{
+    switch (dcache_lookup(cl->fs->dcache, dir, name, name_len, id, type))
+    {
+        case DCACHE_HIT: return 0;
+        case DCACHE_NEG: return -FSERR_NOT_FOUND;
+        default: break;
+    }
+
+    fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, dir));
+    fs_dir_entry_t entry;
+    unsigned bucket_id;
+
+    int ret = dir_find(cl, dir_ptr, name, name_len, &entry, &bucket_id);
+    cache_unpin_ptr(cl->dir_cache, dir_ptr);
+    if (ret == -FSERR_NOT_FOUND) dcache_add_neg(cl->fs->dcache, dir, name, name_len);
+    if (ret != 0) return ret;
+
+    *id = entry.id;
+    *type = entry.type;
+    dcache_add(cl->fs->dcache, dir, name, name_len, *id, *type);
+
+    return 0;
+}
+
+int fs_lookup(client_t *cl, unsigned dir, const char *name, unsigned *id, unsigned *type)
+{
+    lock_block(cl, dir);
+
+    int ret = lookup(cl, dir, name, strlen(name), id, type);
+
+    unlock_block(cl, dir);
+
+    return ret;
+}
+
+// Entries that were just listed tend to be looked up next, so their blocks
+// are brought in a batch at a time rather than one round trip each
+void fs_prefetch(client_t *cl, const unsigned *ids, unsigned count)
+{
+    blk_id_t batch[CLIENT_RD_BATCH];
+    unsigned max = cl->dir_cache->n_blk / 2;
+    unsigned n = 0;
+
+    if (count > max) count = max;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        batch[n++] = ids[i];
+
+        if (n == CLIENT_RD_BATCH || i + 1 == count)
+        {
+            cache_prefetch(cl->dir_cache, batch, n);
+            n = 0;
+        }
+    }
+}
+
+int fs_get_type(client_t *cl, unsigned id, unsigned *type)
+{
+    if (id < cl->fs->first || id >= cl->fs->total_count) return -FSERR_NOT_FOUND;
+
+    // a stale inode number may name a block that has since been freed
+    unsigned char *map = verify_ptr(cache_pin_blk(cl->sb_cache, 1 + id / MAP_BITS));
+
+    pthread_mutex_lock(&cl->fs->alloc_lock);
+    int taken = map_test(map, id) && !free_pending(cl->fs, id);
+    pthread_mutex_unlock(&cl->fs->alloc_lock);
+
+    cache_unpin_ptr(cl->sb_cache, map);
+
+    if (!taken) return -FSERR_NOT_FOUND;
+
+    fs_dir_t *dir = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+    *type = dir->type;
+    cache_unpin_ptr(cl->dir_cache, dir);
+
+    return 0;
+}
+
+int fs_find_block(client_t *cl, unsigned root, const char *path, unsigned *id, unsigned *type)
+{
+    *id = cl->fs->root;
+    *type = FS_DIR;
+
+    const char *begin = path;
+
+    for (;;)
+    {
+        if (!parse_name(&begin, &path)) break;
+
+        unsigned name_len = path - begin;
+
+        if (*type == FS_FILE) return -FSERR_NOT_FOUND;
+
+        if (name_len == 1 && begin[0] == '.') continue;
+
+        if (name_len == 2 && begin[0] == '.' && begin[1] == '.')
+        {
+            fs_dir_t *dir = verify_ptr(cache_pin_blk(cl->dir_cache, *id));
+            *id = dir->parent;
+            cache_unpin_ptr(cl->dir_cache, dir);
+            continue;
+        }
+
+        unsigned dir = *id;
+
+        lock_block(cl, dir);
+        int ret = lookup(cl, dir, begin, name_len, id, type);
+        unlock_block(cl, dir);
+
+        if (ret != 0) return ret;
+    }
+
+    return 0;
+}
+
+static int add_entry(client_t *cl, unsigned dir, fs_dir_t *dir_ptr, const char *name, unsigned name_len, unsigned type, unsigned id)
+{
+    fs_dir_entry_t old;
+    unsigned bucket_id;
+
+    if (dir_find(cl, dir_ptr, name, name_len - 1, &old, &bucket_id) == 0) return -FSERR_EXISTS;
+
+    fs_dir_entry_t entry = { type, "", id };
+    memcpy(entry.name, name, name_len);
+
+    int ret = dir_insert(cl, dir_ptr, &entry);
+    if (ret != 0) return ret;
+
+    dcache_add(cl->fs->dcache, dir, name, name_len - 1, id, type);
+
+    return 0;
+}
+
+static int space_left(fs_info_t *fs)
+{
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    int left = fs->free_count != 0 || fs->defer_count != 0;
+
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return left;
+}
+
+static int create_dir(client_t *cl, unsigned parent, fs_dir_t *dir_ptr, const char *name, unsigned name_len, unsigned *id)
+{
+    unsigned did = block_alloc(cl);
+    if (did == 0) return -FSERR_OOM;
+
+    // the block is ready before any entry can lead to it
+    fs_dir_t *this_dir = cache_pin_claim(cl->dir_cache, did);
+    if (this_dir == NULL)
+    {
+        block_free(cl, did);
+        return -FSERR_IO;
+    }
+
+    memset(this_dir, 0, sizeof*(this_dir));
+    this_dir->type   = FS_DIR;
+    this_dir->parent = parent;
+    cache_dirty_ptr(cl->dir_cache, this_dir);
+    cache_unpin_ptr(cl->dir_cache, this_dir);
+
+    int ret = add_entry(cl, parent, dir_ptr, name, name_len, FS_DIR, did);
+    if (ret != 0)
+    {
+        block_free(cl, did);
+        return ret;
+    }
+
+    *id = did;
+    cache_dirty_ptr(cl->dir_cache, dir_ptr);
+
+    return 0;
+}
+
+int fs_create_dir(client_t *cl, unsigned parent, const char *name, unsigned *id)
+{
+    unsigned name_len = strlen(name) + 1; // include \0
+
+    if (name_len > NAME_MAX_LEN) return -FSERR_LONG_NAME;
+    if (!space_left(cl->fs)) return -FSERR_OOM;
+
+    fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, parent));
+
+    lock_block(cl, parent);
+
+    int ret = create_dir(cl, parent, dir_ptr, name, name_len, id);
+
+    unlock_block(cl, parent);
+
+    cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+    return ret;
+}
+
+static int create_file(client_t *cl, unsigned dir, fs_dir_t *dir_ptr, const char *name, unsigned name_len, unsigned *id)
+{
+    unsigned fid = block_alloc(cl);
+    if (fid == 0) return -FSERR_OOM;
+
+    // the block is ready before any entry can lead to it
+    fs_file_t *file = cache_pin_claim(cl->dir_cache, fid);
+    if (file == NULL)
+    {
+        block_free(cl, fid);
+        return -FSERR_IO;
+    }
+
+    memset(file, 0, BLOCK_SIZE);
+    file->type    = FS_FILE;
+    file->parent  = dir;
+    file->inlined = 1;
+    cache_dirty_ptr(cl->dir_cache, file);
+    cache_unpin_ptr(cl->dir_cache, file);
+
+    int ret = add_entry(cl, dir, dir_ptr, name, name_len, FS_FILE, fid);
+    if (ret != 0)
+    {
+        block_free(cl, fid);
+        return ret;
+    }
+
+    *id = fid;
+    cache_dirty_ptr(cl->dir_cache, dir_ptr);
+
+    return 0;
+}
+
+int fs_create_file(client_t *cl, unsigned dir, const char *name, unsigned *id)
+{
+    unsigned name_len = strlen(name) + 1; // include \0
+
+    if (name_len > NAME_MAX_LEN) return -FSERR_LONG_NAME;
+    if (!space_left(cl->fs)) return -FSERR_OOM;
+
+    fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, dir));
+
+    lock_block(cl, dir);
+
+    int ret = create_file(cl, dir, dir_ptr, name, name_len, id);
+
+    unlock_block(cl, dir);
+
+    cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+    return ret;
+}
+
+// A file maps its blocks 0..block_count-1 through extents of contiguous block
+// ids, sorted by logical block. Blocks no extent covers are holes and read as
+// zeros. The extents form a B+tree rooted in the inode. Leaves hold extents,
+// while index entries hold the first logical block below a child node and the
+// child's id in start. Nodes live in dir_cache like any other metadata.
+
+// Index of the last entry that starts at or before lblk, or -1
+static int node_search(const fs_extent_t *ent, unsigned count, unsigned lblk)
+{
+    int lo = 0;
+    int hi = count;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (ent[mid].lblk <= lblk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo - 1;
+}
+
+// The walks down the tree hold a pin on one node at a time, the inode being
+// pinned by the caller
+
+// Look up the block holding lblk, or 0 in id when it falls in a hole
+static int file_block(client_t *cl, const fs_file_t *fptr, unsigned lblk, unsigned *id)
+{
+    const fs_extent_t *ent = fptr->extents;
+    unsigned count = fptr->extent_count;
+    unsigned depth = fptr->depth;
+    fs_node_t *node = NULL;
+
+    *id = 0;
+
+    for (;;)
+    {
+        int i = node_search(ent, count, lblk);
+        unsigned child = 0;
+
+        if (i >= 0 && depth == 0 && lblk < ent[i].lblk + ent[i].len) *id = ent[i].start + (lblk - ent[i].lblk);
+        if (i >= 0 && depth > 0) child = ent[i].start;
+
+        if (node != NULL) cache_unpin_ptr(cl->dir_cache, node);
+        if (child == 0) return 0;
+
+        node = verify_ptr(cache_pin_blk(cl->dir_cache, child));
+
+        ent   = node->entries;
+        count = node->count;
+        depth = node->depth;
+    }
+}
+
+// Copy out the last extent starting at or before lblk, with len 0 when there
+// is none, along with the first logical block mapped after it. That extent
+// grows by grow blocks on the way.
+static int find_extent(client_t *cl, fs_file_t *fptr, unsigned lblk, unsigned grow, fs_extent_t *ext, unsigned *next)
+{
+    fs_extent_t *ent = fptr->extents;
+    unsigned count = fptr->extent_count;
+    unsigned depth = fptr->depth;
+    fs_node_t *node = NULL;
+
+    memset(ext, 0, sizeof(*ext));
+    *next = UINT_MAX;
+
+    for (;;)
+    {
+        int i = node_search(ent, count, lblk);
+
+        if (i + 1 < (int)count) *next = ent[i + 1].lblk;
+
+        if (depth == 0)
+        {
+            if (i >= 0 && grow != 0)
+            {
+                ent[i].len += grow;
+                if (node != NULL) cache_dirty_ptr(cl->dir_cache, node);
+            }
+
+            if (i >= 0) *ext = ent[i];
+            if (node != NULL) cache_unpin_ptr(cl->dir_cache, node);
+
+            return 0;
+        }
+
+        if (i < 0) i = 0;
+
+        unsigned child = ent[i].start;
+
+        if (node != NULL) cache_unpin_ptr(cl->dir_cache, node);
+
+        node = verify_ptr(cache_pin_blk(cl->dir_cache, child));
+
+        ent   = node->entries;
+        count = node->count;
+        depth = node->depth;
+    }
+}
+
+// The nodes an insert splits into are allocated before the tree is touched,
+// so that running out of space never leaves half a split behind
+#define NODE_POOL_MAX 16
+
+typedef struct {
+    unsigned   count;
+    unsigned   id[NODE_POOL_MAX];
+    fs_node_t *node[NODE_POOL_MAX];
+} node_pool_t;
+
+// Count the nodes inserting at lblk will split. A split runs up from the leaf
+// for as long as the nodes are full, and splitting the root takes two.
+static int count_splits(client_t *cl, fs_file_t *fptr, unsigned lblk, unsigned *needed)
+{
+    const fs_extent_t *ent = fptr->extents;
+    unsigned count = fptr->extent_count;
+    unsigned depth = fptr->depth;
+    unsigned cap = FILE_ROOT_EXTENTS;
+    unsigned levels = 0;
+    unsigned full = 0;
+    fs_node_t *node = NULL;
+
+    for (;;)
+    {
+        full = count < cap ? 0 : full + 1;
+        levels++;
+
+        if (depth == 0) break;
+
+        int i = node_search(ent, count, lblk);
+        if (i < 0) i = 0;
+
+        unsigned child = ent[i].start;
+
+        if (node != NULL) cache_unpin_ptr(cl->dir_cache, node);
+
+        node = verify_ptr(cache_pin_blk(cl->dir_cache, child));
+
+        ent   = node->entries;
+        count = node->count;
+        depth = node->depth;
+        cap   = NODE_MAX_ENTRIES;
+    }
+
+    if (node != NULL) cache_unpin_ptr(cl->dir_cache, node);
+
+    *needed = full + (full == levels);
+
+    return *needed > NODE_POOL_MAX ? -FSERR_OVERFLOW : 0;
+}
+
+static void pool_release(client_t *cl, node_pool_t *pool)
+{
+    while (pool->count > 0)
+    {
+        pool->count--;
+        cache_unpin_ptr(cl->dir_cache, pool->node[pool->count]);
+        block_free(cl, pool->id[pool->count]);
+    }
+}
+
+static int pool_fill(client_t *cl, node_pool_t *pool, unsigned needed)
+{
+    pool->count = 0;
+
+    while (pool->count < needed)
+    {
+        unsigned id = block_alloc(cl);
+        if (id == 0) break;
+
+        fs_node_t *node = cache_pin_claim(cl->dir_cache, id);
+        if (node == NULL)
+        {
+            block_free(cl, id);
+            break;
+        }
+
+        pool->id[pool->count]   = id;
+        pool->node[pool->count] = node;
+        pool->count++;
+    }
+
+    if (pool->count == needed) return 0;
+
+    pool_release(cl, pool);
+
+    return -FSERR_OOM;
+}
+
+static unsigned node_take(client_t *cl, node_pool_t *pool, unsigned depth, const fs_extent_t *ent, unsigned count)
+{
+    pool->count--;
+
+    unsigned id = pool->id[pool->count];
+    fs_node_t *node = pool->node[pool->count];
+
+    node->depth = depth;
+    node->count = count;
+    memcpy(node->entries, ent, count * sizeof(fs_extent_t));
+    cache_dirty_ptr(cl->dir_cache, node);
+    cache_unpin_ptr(cl->dir_cache, node);
+
+    return id;
+}
+
+static void node_put(fs_extent_t *ent, unsigned *count, unsigned pos, const fs_extent_t *entry)
+{
+    memmove(&ent[pos + 1], &ent[pos], (*count - pos) * sizeof(fs_extent_t));
+    ent[pos] = *entry;
+    (*count)++;
+}
+
+// Insert ext below ent in lblk order. When the node is already full, a new
+// sibling takes the upper half and the entry for it is left in split for the
+// parent. Returns 1 in that case. Appends start the sibling empty instead, so
+// that files written front to back fill their nodes.
+static int node_insert(client_t *cl, node_pool_t *pool, fs_extent_t *ent, unsigned *count, unsigned cap, unsigned depth, const fs_extent_t *ext, fs_extent_t *split)
+{
+    fs_extent_t entry = *ext;
+    unsigned pos = node_search(ent, *count, ext->lblk) + 1;
+
+    if (depth > 0)
+    {
+        // the first child takes anything before it, and its key follows
+        if (pos == 0)
+        {
+            ent[0].lblk = ext->lblk;
+            pos = 1;
+        }
+
+        unsigned child_id = ent[pos - 1].start;
+        fs_node_t *child = verify_ptr(cache_pin_blk(cl->dir_cache, child_id));
+
+        int ret = node_insert(cl, pool, child->entries, &child->count, NODE_MAX_ENTRIES, child->depth, ext, &entry);
+
+        cache_dirty_ptr(cl->dir_cache, child);
+        cache_unpin_ptr(cl->dir_cache, child);
+
+        if (ret != 1) return ret;
+    }
+
+    if (*count < cap)
+    {
+        node_put(ent, count, pos, &entry);
+        return 0;
+    }
+
+    if (pos == *count)
+    {
+        split->lblk  = entry.lblk;
+        split->start = node_take(cl, pool, depth, &entry, 1);
+    }
+    else
+    {
+        unsigned half = *count / 2;
+
+        split->lblk  = ent[half].lblk;
+        split->start = node_take(cl, pool, depth, &ent[half], *count - half);
+
+        *count = half;
+
+        if (pos <= half)
+        {
+            node_put(ent, count, pos, &entry);
+        }
+        else
+        {
+            fs_node_t *sibling = verify_ptr(cache_pin_blk(cl->dir_cache, split->start));
+            node_put(sibling->entries, &sibling->count, pos - half, &entry);
+            cache_dirty_ptr(cl->dir_cache, sibling);
+            cache_unpin_ptr(cl->dir_cache, sibling);
+        }
+    }
+
+    split->len = 0;
+
+    return 1;
+}
+
+// Only -FSERR_OOM guarantees that ext was left out of the tree
+static int tree_insert(client_t *cl, fs_file_t *fptr, const fs_extent_t *ext)
+{
+    node_pool_t pool;
+    fs_extent_t split;
+    unsigned needed;
+
+    int ret = count_splits(cl, fptr, ext->lblk, &needed);
+    if (ret != 0) return ret;
+
+    ret = pool_fill(cl, &pool, needed);
+    if (ret != 0) return ret;
+
+    ret = node_insert(cl, &pool, fptr->extents, &fptr->extent_count, FILE_ROOT_EXTENTS, fptr->depth, ext, &split);
+
+    if (ret == 1)
+    {
+        // the root is full, so its entries move down into a new node
+        unsigned id = node_take(cl, &pool, fptr->depth, fptr->extents, fptr->extent_count);
+
+        fptr->extents[0].start = id;
+        fptr->extents[0].len   = 0;
+        fptr->extents[1]       = split;
+        fptr->extent_count     = 2;
+        fptr->depth++;
+
+        ret = 0;
+    }
+
+    pool_release(cl, &pool);
+
+    return ret;
+}
+
+// Free everything from logical block block_count on, and any node left empty
+static int node_trim(client_t *cl, fs_extent_t *ent, unsigned *count, unsigned depth, unsigned block_count)
+{
+    while (*count > 0)
+    {
+        fs_extent_t *last = &ent[*count - 1];
+
+        if (depth == 0)
+        {
+            unsigned keep = last->lblk < block_count ? block_count - last->lblk : 0;
+            if (keep >= last->len) return 0;
+
+            while (last->len > keep)
+            {
+                int ret = block_free(cl, last->start + last->len - 1);
+                if (ret != 0) return ret;
+                last->len--;
+            }
+
+            if (last->len != 0) return 0;
+        }
+        else
+        {
+            unsigned child_id = last->start;
+            fs_node_t *child = verify_ptr(cache_pin_blk(cl->dir_cache, child_id));
+
+            int ret = node_trim(cl, child->entries, &child->count, child->depth, block_count);
+            unsigned empty = child->count == 0;
+
+            cache_dirty_ptr(cl->dir_cache, child);
+            cache_unpin_ptr(cl->dir_cache, child);
+
+            if (ret != 0) return ret;
+            if (!empty) return 0;
+
+            ret = block_free(cl, child_id);
+            if (ret != 0) return ret;
+        }
+
+        (*count)--;
+    }
+
+    return 0;
+}
+
+static int shrink_file(client_t *cl, fs_file_t *fptr, unsigned block_count)
+{
+    int ret = node_trim(cl, fptr->extents, &fptr->extent_count, fptr->depth, block_count);
+    if (ret != 0) return ret;
+
+    if (fptr->extent_count == 0) fptr->depth = 0;
+
+    // pull a lone child back into the inode once it fits
+    while (fptr->depth > 0 && fptr->extent_count == 1)
+    {
+        unsigned child_id = fptr->extents[0].start;
+        fs_node_t *child = verify_ptr(cache_pin_blk(cl->dir_cache, child_id));
+
+        if (child->count > FILE_ROOT_EXTENTS)
+        {
+            cache_unpin_ptr(cl->dir_cache, child);
+            break;
+        }
+
+        memcpy(fptr->extents, child->entries, child->count * sizeof(fs_extent_t));
+        fptr->extent_count = child->count;
+        fptr->depth        = child->depth;
+
+        cache_unpin_ptr(cl->dir_cache, child);
+
+        ret = block_free(cl, child_id);
+        if (ret != 0) return ret;
+    }
+
+    if (fptr->block_count > block_count) fptr->block_count = block_count;
+
+    return 0;
+}
+
+// Blocks are only allocated once data lands in a hole. The hole at lblk gets
+// a run of up to want blocks, tried right after the extent before it so that
+// it can just grow. The length mapped is left in len.
+static int fill_hole(client_t *cl, fs_file_t *fptr, unsigned lblk, unsigned want, unsigned *len)
+{
+    fs_extent_t prev;
+    unsigned next;
+    unsigned goal = 0;
+
+    int ret = find_extent(cl, fptr, lblk, 0, &prev, &next);
+    if (ret != 0) return ret;
+
+    if (want > next - lblk) want = next - lblk;
+    if (prev.len != 0) goal = prev.start + prev.len;
+
+    unsigned adjacent = prev.len != 0 && prev.lblk + prev.len == lblk;
+
+    unsigned start = block_alloc_run(cl, goal, want, len);
+    if (start == 0) return -FSERR_OOM;
+
+    // the extent before just grows into the run
+    if (adjacent && start == goal) return find_extent(cl, fptr, lblk, *len, &prev, &next);
+
+    fs_extent_t ext = { lblk, start, *len };
+
+    ret = tree_insert(cl, fptr, &ext);
+
+    // blocks the tree may already map are lost rather than freed
+    if (ret == -FSERR_OOM)
+    {
+        for (unsigned i = 0; i < *len; i++) block_free(cl, start + i);
+    }
+
+    return ret;
+}
+
+static int free_file(client_t *cl, unsigned id)
+{
+    fs_file_t *file_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    lock_block(cl, id);
+
+    int ret = shrink_file(cl, file_ptr, 0);
+
+    unlock_block(cl, id);
+
+    cache_unpin_ptr(cl->dir_cache, file_ptr);
+
+    if (ret != 0) return ret;
+
+    return block_free(cl, id);
+}
+
+// Only empty directories are removed, so there is no subtree left to free
+static int free_dir(client_t *cl, unsigned id)
+{
+    fs_dir_t *dir = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    int ret = dir->hashed ? free_buckets(cl, dir) : 0;
+
+    dcache_forget_dir(cl->fs->dcache, id);
+
+    cache_unpin_ptr(cl->dir_cache, dir);
+
+    if (ret != 0) return ret;
+
+    return block_free(cl, id);
+}
+
+// Point a moved file or directory at the directory it now lives in. Nothing
+// else in the inode changes with its parent, so its own lock is not needed.
+static int set_parent(client_t *cl, unsigned id, unsigned type, unsigned parent)
+{
+    if (type == FS_DIR)
+    {
+        fs_dir_t *dir = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+        dir->parent = parent;
+        cache_dirty_ptr(cl->dir_cache, dir);
+        cache_unpin_ptr(cl->dir_cache, dir);
+    }
+    else
+    {
+        fs_file_t *file = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+        file->parent = parent;
+        cache_dirty_ptr(cl->dir_cache, file);
+        cache_unpin_ptr(cl->dir_cache, file);
+    }
+
+    return 0;
+}
+
+static unsigned ref_hash(const fs_info_t *fs, unsigned id)
+{
+    return (id * 0x9E3779B1u) & fs->ref_mask;
+}
+
+static fs_ref_t *ref_find(fs_info_t *fs, unsigned id)
+{
+    for (unsigned i = ref_hash(fs, id); fs->refs[i].id != 0; i = (i + 1) & fs->ref_mask)
+    {
+        if (fs->refs[i].id == id) return &fs->refs[i];
+    }
+
+    return NULL;
+}
+
+static fs_ref_t *ref_slot(fs_info_t *fs, unsigned id)
+{
+    unsigned i = ref_hash(fs, id);
+
+    while (fs->refs[i].id != 0) i = (i + 1) & fs->ref_mask;
+
+    return &fs->refs[i];
+}
+
+// The table is kept at most half full
+static int ref_grow(fs_info_t *fs)
+{
+    fs_ref_t *old   = fs->refs;
+    unsigned  n_old = fs->ref_mask + 1;
+
+    fs->refs = calloc(2 * n_old, sizeof(fs_ref_t));
+    if (fs->refs == NULL)
+    {
+        fs->refs = old;
+        return -FSERR_OOM;
+    }
+
+    fs->ref_mask = 2 * n_old - 1;
+
+    for (unsigned i = 0; i < n_old; i++)
+    {
+        if (old[i].id != 0) *ref_slot(fs, old[i].id) = old[i];
+    }
+
+    free(old);
+
+    return 0;
+}
+
+// Entries displaced past the removed one are shifted back, so no tombstones
+// are needed
+static void ref_remove(fs_info_t *fs, fs_ref_t *ref)
+{
+    unsigned i = ref - fs->refs;
+    unsigned j = i;
+
+    fs->refs[i].id = 0;
+    fs->ref_count--;
+
+    for (;;)
+    {
+        j = (j + 1) & fs->ref_mask;
+        if (fs->refs[j].id == 0) return;
+
+        unsigned home = ref_hash(fs, fs->refs[j].id);
+        if (((j - home) & fs->ref_mask) < ((j - i) & fs->ref_mask)) continue;
+
+        fs->refs[i] = fs->refs[j];
+        fs->refs[j].id = 0;
+        i = j;
+    }
+}
+
+// An inode that is still open, or otherwise known to the kernel, outlives its
+// name. Its id is not handed out again until the kernel has forgotten it. A
+// directory is locked by the caller.
+static int release_inode(client_t *cl, unsigned id, unsigned type)
+{
+    fs_info_t *fs = cl->fs;
+
+    // it is its own parent now, like the root, so nothing leads back to the
+    // directory it was in, which may be gone by the time it is used. This
+    // comes first, since an orphan may be freed as soon as it is marked.
+    int ret = set_parent(cl, id, type, id);
+    if (ret != 0) return ret;
+
+    pthread_mutex_lock(&fs->lock);
+
+    fs_ref_t *ref = ref_find(fs, id);
+    if (ref != NULL)
+    {
+        ref->orphan = 1;
+        ref->type   = type;
+    }
+
+    pthread_mutex_unlock(&fs->lock);
+
+    if (ref != NULL) return 0;
+
+    return type == FS_DIR ? free_dir(cl, id) : free_file(cl, id);
+}
+
+static int free_orphan(client_t *cl, unsigned id, unsigned type)
+{
+    if (type == FS_FILE) return free_file(cl, id);
+
+    lock_block(cl, id);
+
+    int ret = free_dir(cl, id);
+
+    unlock_block(cl, id);
+
+    return ret;
+}
+
+// A directory to delete is locked by the caller
+static int delete_entry(client_t *cl, unsigned dir, fs_dir_t *dir_ptr, const char *name, unsigned type)
+{
+    unsigned name_len = strlen(name);
+    fs_dir_entry_t entry;
+    unsigned bucket_id;
+
+    int ret = dir_find(cl, dir_ptr, name, name_len, &entry, &bucket_id);
+    if (ret != 0) return ret;
+    if (entry.type != type) return -FSERR_NOT_DIR;
+
+    unsigned id = entry.id;
+
+    if (type == FS_DIR)
+    {
+        fs_dir_t *child = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+        unsigned empty = child->entry_count == 0;
+        cache_unpin_ptr(cl->dir_cache, child);
+
+        if (!empty) return -FSERR_NOT_EMPTY;
+    }
+
+    ret = dir_remove(cl, dir_ptr, name, name_len);
+    if (ret != 0) return ret;
+
+    dcache_add_neg(cl->fs->dcache, dir, name, name_len);
+
+    cache_dirty_ptr(cl->dir_cache, dir_ptr);
+
+    return release_inode(cl, id, type);
+}
+
+int fs_delete_file(client_t *cl, unsigned dir, const char *name)
+{
+    fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, dir));
+
+    lock_block(cl, dir);
+
+    int ret = delete_entry(cl, dir, dir_ptr, name, FS_FILE);
+
+    unlock_block(cl, dir);
+
+    cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+    return ret;
+}
+
+// The directory going away is locked as well, so nothing is created in it
+// between the check that it is empty and its removal. Its name cannot move
+// on while the parent is held.
+int fs_delete_dir(client_t *cl, unsigned dir, const char *name)
+{
+    fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, dir));
+    fs_dir_entry_t entry;
+    unsigned bucket_id;
+
+    lock_block(cl, dir);
+
+    int ret = dir_find(cl, dir_ptr, name, strlen(name), &entry, &bucket_id);
+    unsigned child = ret == 0 && entry.type == FS_DIR ? entry.id : 0;
+
+    if (child != 0) lock_block(cl, child);
+    if (ret == 0) ret = delete_entry(cl, dir, dir_ptr, name, FS_DIR);
+    if (child != 0) unlock_block(cl, child);
+
+    unlock_block(cl, dir);
+
+    cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+    return ret;
+}
+
+// Whether up is dir or one of its ancestors. Only renames across directories
+// change parents, and they hold rename_lock, as does the caller.
+static int is_ancestor(client_t *cl, unsigned up, unsigned dir, unsigned *result)
+{
+    *result = 0;
+
+    for (;;)
+    {
+        if (dir == up)
+        {
+            *result = 1;
+            return 0;
+        }
+
+        fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, dir));
+        unsigned parent = dir_ptr->parent;
+        cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+        if (parent == dir) return 0;
+        dir = parent;
+    }
+}
+
+// Only the entries move, the inode and its data stay where they are
+static int move_entry(client_t *cl, unsigned dir, fs_dir_t *dir_ptr, const char *name,
+                      unsigned new_dir, fs_dir_t *new_ptr, const char *new_name)
+{
+    unsigned name_len = strlen(name);
+    unsigned new_len  = strlen(new_name);
+    fs_dir_entry_t entry;
+    unsigned bucket_id;
+
+    if (new_len + 1 > NAME_MAX_LEN) return -FSERR_LONG_NAME;
+
+    int ret = dir_find(cl, dir_ptr, name, name_len, &entry, &bucket_id);
+    if (ret != 0) return ret;
+
+    unsigned id   = entry.id;
+    unsigned type = entry.type;
+
+    // a directory cannot become its own descendant
+    if (type == FS_DIR && dir != new_dir)
+    {
+        unsigned inside;
+
+        ret = is_ancestor(cl, id, new_dir, &inside);
+        if (ret != 0) return ret;
+        if (inside) return -FSERR_INVAL;
+    }
+
+    unsigned victim = 0;
+
+    if (dir_find(cl, new_ptr, new_name, new_len, &entry, &bucket_id) == 0)
+    {
+        if (entry.id == id) return 0;
+        if (entry.type != type) return -FSERR_NOT_DIR;
+
+        victim = entry.id;
+
+        // a directory replaced is emptied first, and the one the entry comes
+        // from is not empty
+        if (type == FS_DIR && victim == dir) return -FSERR_NOT_EMPTY;
+
+        if (type == FS_DIR)
+        {
+            fs_dir_t *victim_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, victim));
+            unsigned empty = victim_ptr->entry_count == 0;
+            cache_unpin_ptr(cl->dir_cache, victim_ptr);
+
+            if (!empty) return -FSERR_NOT_EMPTY;
+        }
+
+        // the existing entry is taken over where it stands
+        ret = dir_set_id(cl, new_ptr, new_name, new_len, id);
+        if (ret != 0) return ret;
+    }
+    else
+    {
+        fs_dir_entry_t new_entry = { type, "", id };
+        memcpy(new_entry.name, new_name, new_len + 1);
+
+        ret = dir_insert(cl, new_ptr, &new_entry);
+        if (ret != 0) return ret;
+    }
+
+    ret = dir_remove(cl, dir_ptr, name, name_len);
+    if (ret != 0)
+    {
+        // put the target back the way it was
+        if (victim != 0)
+        {
+            dir_set_id(cl, new_ptr, new_name, new_len, victim);
+        }
+        else
+        {
+            dir_remove(cl, new_ptr, new_name, new_len);
+        }
+
+        return ret;
+    }
+
+    dcache_add_neg(cl->fs->dcache, dir, name, name_len);
+    dcache_add(cl->fs->dcache, new_dir, new_name, new_len, id, type);
+
+    cache_dirty_ptr(cl->dir_cache, dir_ptr);
+    cache_dirty_ptr(cl->dir_cache, new_ptr);
+
+    if (dir != new_dir)
+    {
+        ret = set_parent(cl, id, type, new_dir);
+        if (ret != 0) return ret;
+    }
+
+    // the replaced inode may still be open, like one that is unlinked
+    if (victim == 0) return 0;
+
+    return release_inode(cl, victim, type);
+}
+
+// Lock both directories of a rename, an ancestor before its descendant
+static int lock_rename(client_t *cl, unsigned dir, unsigned new_dir)
+{
+    unsigned first = 0;
+
+    if (dir == new_dir)
+    {
+        lock_block(cl, dir);
+        return 0;
+    }
+
+    pthread_mutex_lock(&cl->fs->rename_lock);
+
+    int ret = is_ancestor(cl, dir, new_dir, &first);
+    if (ret == 0 && first)
+    {
+        lock_block(cl, dir);
+        lock_block(cl, new_dir);
+        return 0;
+    }
+
+    if (ret == 0) ret = is_ancestor(cl, new_dir, dir, &first);
+    if (ret == 0 && first)
+    {
+        lock_block(cl, new_dir);
+        lock_block(cl, dir);
+        return 0;
+    }
+
+    if (ret == 0)
+    {
+        lock_pair(cl, dir, new_dir);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&cl->fs->rename_lock);
+
+    return ret;
+}
+
+static void unlock_rename(client_t *cl, unsigned dir, unsigned new_dir)
+{
+    unlock_block(cl, dir);
+    if (dir == new_dir) return;
+
+    unlock_block(cl, new_dir);
+    pthread_mutex_unlock(&cl->fs->rename_lock);
+}
+
+int fs_rename(client_t *cl, unsigned dir, const char *name, unsigned new_dir, const char *new_name)
+{
+    fs_dir_t *dir_ptr = cache_pin_blk(cl->dir_cache, dir);
+    fs_dir_t *new_ptr = cache_pin_blk(cl->dir_cache, new_dir);
+    int ret = -FSERR_IO;
+
+    if (dir_ptr != NULL && new_ptr != NULL) ret = lock_rename(cl, dir, new_dir);
+
+    if (ret == 0)
+    {
+        fs_dir_entry_t entry;
+        unsigned bucket_id;
+        unsigned victim = 0;
+
+        // A directory about to be replaced is locked like one deleted. One
+        // above the source is not, as it cannot be empty and is not touched.
+        if (dir_find(cl, new_ptr, new_name, strlen(new_name), &entry, &bucket_id) == 0 && entry.type == FS_DIR)
+        {
+            unsigned above = 0;
+
+            if (dir != new_dir) ret = is_ancestor(cl, entry.id, dir, &above);
+            if (ret == 0 && !above && entry.id != dir) victim = entry.id;
+        }
+
+        if (victim != 0) lock_block(cl, victim);
+
+        if (ret == 0) ret = move_entry(cl, dir, dir_ptr, name, new_dir, new_ptr, new_name);
+
+        if (victim != 0) unlock_block(cl, victim);
+
+        unlock_rename(cl, dir, new_dir);
+    }
+
+    if (new_ptr != NULL) cache_unpin_ptr(cl->dir_cache, new_ptr);
+    if (dir_ptr != NULL) cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+    return ret;
+}
+
+// The kernel has been handed the inode once more
+int fs_ref(client_t *cl, unsigned id)
+{
+    fs_info_t *fs = cl->fs;
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->lock);
+
+    fs_ref_t *ref = ref_find(fs, id);
+
+    if (ref == NULL && 2 * (fs->ref_count + 1) > fs->ref_mask + 1) ret = ref_grow(fs);
+
+    if (ref == NULL && ret == 0)
+    {
+        ref = ref_slot(fs, id);
+        ref->id      = id;
+        ref->orphan  = 0;
+        ref->nlookup = 0;
+        fs->ref_count++;
+    }
+
+    if (ret == 0) ref->nlookup++;
+
+    pthread_mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+int fs_forget(client_t *cl, unsigned id, uint64_t nlookup)
+{
+    fs_info_t *fs = cl->fs;
+    unsigned orphan = 0;
+    unsigned type = 0;
+
+    pthread_mutex_lock(&fs->lock);
+
+    fs_ref_t *ref = ref_find(fs, id);
+
+    if (ref != NULL && ref->nlookup > nlookup)
+    {
+        ref->nlookup -= nlookup;
+    }
+    else if (ref != NULL)
+    {
+        orphan = ref->orphan;
+        type   = ref->type;
+
+        ref_remove(fs, ref);
+    }
+
+    pthread_mutex_unlock(&fs->lock);
+
+    return orphan ? free_orphan(cl, id, type) : 0;
+}
+
+// The kernel forgets everything on unmount without always saying so
+int fs_free_orphans(client_t *cl)
+{
+    fs_info_t *fs = cl->fs;
+    int ret = 0;
+
+    if (fs == NULL) return 0;
+
+    pthread_mutex_lock(&fs->lock);
+
+    for (unsigned i = 0; i <= fs->ref_mask; )
+    {
+        fs_ref_t *ref = &fs->refs[i];
+
+        if (ref->id == 0 || !ref->orphan)
+        {
+            i++;
+            continue;
+        }
+
+        // removal may shift another entry into this slot
+        unsigned id   = ref->id;
+        unsigned type = ref->type;
+
+        ref_remove(fs, ref);
+
+        pthread_mutex_unlock(&fs->lock);
+        if (free_orphan(cl, id, type) != 0) ret = -FSERR_IO;
+        pthread_mutex_lock(&fs->lock);
+    }
+
+    pthread_mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+// Blocks that are overwritten in full, or were allocated by this write, are
+// claimed instead of fetched. Only the rest of a fresh block needs zeroing.
+static const unsigned char zero_block[BLOCK_SIZE];
+
+// A file small enough to fit keeps its data in the inode, which saves a block
+// and a fetch. Bytes past the end stay zero so that growing needs no clearing.
+static unsigned char *inline_data(fs_file_t *fptr)
+{
+    return (unsigned char *)fptr->extents;
+}
+
+// Moves inline data out to a block of its own before the file outgrows the
+// inode. The file is left as it was on failure.
+static int uninline_file(client_t *cl, fs_file_t *fptr)
+{
+    unsigned char data[FILE_INLINE_MAX];
+    unsigned size = fptr->size;
+
+    memcpy(data, inline_data(fptr), size);
+    memset(inline_data(fptr), 0, FILE_INLINE_MAX);
+    fptr->inlined = 0;
+
+    cache_dirty_ptr(cl->dir_cache, fptr);
+
+    if (size == 0) return 0;
+
+    unsigned char *block = NULL;
+    unsigned block_id;
+    unsigned len;
+
+    int ret = fill_hole(cl, fptr, 0, 1, &len);
+    if (ret == 0) ret = file_block(cl, fptr, 0, &block_id);
+
+    if (ret == 0)
+    {
+        block = cache_pin_claim(cl->reg_cache, block_id);
+        if (block == NULL) ret = -FSERR_IO;
+    }
+
+    if (ret != 0)
+    {
+        shrink_file(cl, fptr, 0);
+        memcpy(inline_data(fptr), data, size);
+        fptr->inlined = 1;
+        return ret;
+    }
+
+    memcpy(block, data, size);
+    memset(block + size, 0, BLOCK_SIZE - size);
+    cache_dirty_ptr(cl->reg_cache, block);
+    cache_unpin_ptr(cl->reg_cache, block);
+
+    fptr->block_count = 1;
+
+    return 0;
+}
+
+// Returns the block pinned
+static unsigned char *write_block(client_t *cl, unsigned block_id, int fresh, unsigned start, unsigned stop)
+{
+    if (start == 0 && stop == BLOCK_SIZE)
+    {
+        return cache_pin_claim(cl->reg_cache, block_id);
+    }
+
+    if (!fresh)
+    {
+        return cache_pin_blk(cl->reg_cache, block_id);
+    }
+
+    unsigned char *block = cache_pin_claim(cl->reg_cache, block_id);
+
+    if (block != NULL)
+    {
+        memset(block, 0, start);
+        memset(block + stop, 0, BLOCK_SIZE - stop);
+    }
+
+    return block;
+}
+
+static int write_file(client_t *cl, fs_file_t *fptr, fs_copy_t copy, void *ctx, size_t size, size_t offset, size_t *bytes_written)
+{
+    *bytes_written = 0;
+
+    if (size == 0) return 0;
+
+    if (offset > FILE_MAX_SIZE || size > FILE_MAX_SIZE - offset) return -FSERR_OVERFLOW;
+
+    cache_dirty_ptr(cl->dir_cache, fptr);
+
+    uint64_t stop_pos = size + offset;
+
+    if (fptr->inlined && stop_pos <= FILE_INLINE_MAX)
+    {
+        if (copy(ctx, inline_data(fptr) + offset, 0, size) != 0) return -FSERR_IO;
+        *bytes_written = size;
+        if (stop_pos > fptr->size) fptr->size = stop_pos;
+        return 0;
+    }
+
+    int ret = 0;
+
+    if (fptr->inlined)
+    {
+        ret = uninline_file(cl, fptr);
+        if (ret != 0) return ret;
+    }
+
+    unsigned last_block = (stop_pos - 1) / BLOCK_SIZE;
+    unsigned fresh_from = 0;
+    unsigned fresh_to   = 0;
+    unsigned lblk       = 0;
+
+    while (offset + *bytes_written < stop_pos)
+    {
+        uint64_t pos   = offset + *bytes_written;
+        unsigned start = pos % BLOCK_SIZE;
+        unsigned len   = BLOCK_SIZE - start;
+        unsigned block_id;
+
+        lblk = pos / BLOCK_SIZE;
+        if (len > stop_pos - pos) len = stop_pos - pos;
+
+        ret = file_block(cl, fptr, lblk, &block_id);
+        if (ret != 0) break;
+
+        if (block_id == 0)
+        {
+            unsigned run;
+
+            ret = fill_hole(cl, fptr, lblk, last_block - lblk + 1, &run);
+            if (ret == 0) ret = file_block(cl, fptr, lblk, &block_id);
+            if (ret != 0) break;
+
+            fresh_from = lblk;
+            fresh_to   = lblk + run;
+        }
+
+        int fresh = lblk >= fresh_from && lblk < fresh_to;
+        unsigned char *block = write_block(cl, block_id, fresh, start, start + len);
+
+        if (block == NULL || copy(ctx, block + start, *bytes_written, len) != 0)
+        {
+            if (block != NULL) cache_unpin_ptr(cl->reg_cache, block);
+            ret = -FSERR_IO;
+            break;
+        }
+
+        cache_dirty_ptr(cl->reg_cache, block);
+        cache_unpin_ptr(cl->reg_cache, block);
+        *bytes_written += len;
+        if (pos + len > fptr->size) fptr->size = pos + len;
+    }
+
+    if (fptr->size > (uint64_t)fptr->block_count * BLOCK_SIZE)
+    {
+        fptr->block_count = (fptr->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    // what a failed write leaves of a fresh run must still read as a hole
+    for (unsigned i = lblk > fresh_from ? lblk : fresh_from; ret != 0 && i < fresh_to; i++)
+    {
+        unsigned block_id;
+        unsigned char *block;
+
+        if (file_block(cl, fptr, i, &block_id) != 0 || block_id == 0) continue;
+
+        block = cache_pin_claim(cl->reg_cache, block_id);
+        if (block == NULL) continue;
+
+        memset(block, 0, BLOCK_SIZE);
+        cache_dirty_ptr(cl->reg_cache, block);
+        cache_unpin_ptr(cl->reg_cache, block);
+    }
+
+    return ret;
+}
+
+int fs_write_file_from(client_t *cl, unsigned file, fs_copy_t copy, void *ctx, size_t size, size_t offset, size_t *bytes_written)
+{
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, file));
+
+    lock_block(cl, file);
+
+    int ret = write_file(cl, fptr, copy, ctx, size, offset, bytes_written);
+
+    unlock_block(cl, file);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return ret;
+}
+
+static int copy_buf(void *ctx, void *dst, size_t pos, size_t len)
+{
+    memcpy(dst, (const char *)ctx + pos, len);
+    return 0;
+}
+
+int fs_write_file(client_t *cl, unsigned file, const char *buf, size_t size, size_t offset, size_t *bytes_written)
+{
+    return fs_write_file_from(cl, file, copy_buf, (void *)buf, size, offset, bytes_written);
+}
+
+static int read_file(client_t *cl, fs_file_t *fptr, char *buf, size_t size, size_t offset, size_t *bytes_read)
+{
+    *bytes_read = 0;
+
+    if (size == 0) return 0;
+    if (offset >= fptr->size) return 0;
+
+    uint64_t stop_pos = size + offset;
+    if (stop_pos > fptr->size) stop_pos = fptr->size;
+
+    if (fptr->inlined)
+    {
+        memcpy(buf, inline_data(fptr) + offset, stop_pos - offset);
+        *bytes_read = stop_pos - offset;
+        return 0;
+    }
+
+    while (offset + *bytes_read < stop_pos)
+    {
+        uint64_t pos   = offset + *bytes_read;
+        unsigned start = pos % BLOCK_SIZE;
+        unsigned len   = BLOCK_SIZE - start;
+        unsigned block_id;
+
+        if (len > stop_pos - pos) len = stop_pos - pos;
+
+        int ret = file_block(cl, fptr, pos / BLOCK_SIZE, &block_id);
+        if (ret != 0) return ret;
+
+        if (block_id == 0)
+        {
+            memset(buf + *bytes_read, 0, len);
+        }
+        else
+        {
+            unsigned char *block = verify_ptr(cache_pin_blk(cl->reg_cache, block_id));
+            memcpy(buf + *bytes_read, block + start, len);
+            cache_unpin_ptr(cl->reg_cache, block);
+        }
+
+        *bytes_read += len;
+    }
+
+    return 0;
+}
+
+int fs_read_file(client_t *cl, unsigned file, char *buf, size_t size, size_t offset, size_t *bytes_read)
+{
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, file));
+
+    lock_block(cl, file);
+
+    int ret = read_file(cl, fptr, buf, size, offset, bytes_read);
+
+    unlock_block(cl, file);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return ret;
+}
+
+// Reads in flight may pin at most 1/MAP_SHARE of the data cache between them,
+// and each one half of that
+#define MAP_SHARE 4
+
+static void unpin_iov(client_t *cl, const struct iovec *iov, unsigned count)
+{
+    // Only the cache holding the pointer has anything to unpin
+    for (unsigned i = 0; i < count; i++)
+    {
+        cache_unpin_ptr(cl->reg_cache, iov[i].iov_base);
+        cache_unpin_ptr(cl->dir_cache, iov[i].iov_base);
+    }
+}
+
+// Pins the blocks behind a read so their cached plaintext can be handed out
+// without a copy. Nothing stays pinned on failure. Inline data is handed out
+// from the inode block, which is pinned once more for the purpose, and holes
+// from a shared block of zeros.
+static int map_blocks(client_t *cl, unsigned file, fs_file_t *fptr, unsigned max, size_t size, size_t offset, struct iovec *iov, unsigned *count, size_t *bytes_read)
+{
+    *count = 0;
+    *bytes_read = 0;
+
+    if (offset >= fptr->size) return 0;
+
+    uint64_t stop_pos = (uint64_t)size + offset;
+    if (stop_pos > fptr->size) stop_pos = fptr->size;
+
+    if (!fptr->inlined && stop_pos > offset && (stop_pos - 1) / BLOCK_SIZE - offset / BLOCK_SIZE >= max) return -FSERR_OOM;
+
+    if (fptr->inlined)
+    {
+        if (max == 0) return -FSERR_OOM;
+        if (cache_pin_blk(cl->dir_cache, file) != fptr) return -FSERR_IO;
+
+        iov[0].iov_base = inline_data(fptr) + offset;
+        iov[0].iov_len  = stop_pos - offset;
+        *count = 1;
+        *bytes_read = stop_pos - offset;
+        return 0;
+    }
+
+    while (offset + *bytes_read < stop_pos)
+    {
+        uint64_t pos   = offset + *bytes_read;
+        unsigned lblk  = pos / BLOCK_SIZE;
+        unsigned start = pos % BLOCK_SIZE;
+        unsigned len   = BLOCK_SIZE - start;
+
+        unsigned block_id = 0;
+        unsigned char *block = NULL;
+
+        if (len > stop_pos - pos) len = stop_pos - pos;
+
+        if (*count < max && file_block(cl, fptr, lblk, &block_id) == 0)
+        {
+            block = block_id != 0 ? cache_pin_blk(cl->reg_cache, block_id) : (unsigned char *)zero_block;
+        }
+
+        if (block == NULL)
+        {
+            unpin_iov(cl, iov, *count);
+            *count = 0;
+            *bytes_read = 0;
+            return -FSERR_IO;
+        }
+
+        iov[*count].iov_base = block + start;
+        iov[*count].iov_len  = len;
+        (*count)++;
+        *bytes_read += len;
+    }
+
+    return 0;
+}
+
+static int map_file(client_t *cl, unsigned file, fs_file_t *fptr, size_t size, size_t offset, struct iovec *iov, unsigned *count, size_t *bytes_read)
+{
+    fs_info_t *fs = cl->fs;
+    unsigned max = *count;
+    unsigned limit = cl->reg_cache->n_blk / MAP_SHARE;
+
+    // pinned reads must leave the rest of the cache enough room to work in,
+    // so the most this one may take is set aside before it starts
+    pthread_mutex_lock(&fs->lock);
+
+    unsigned room = fs->mapped < limit ? limit - fs->mapped : 0;
+    if (max > limit / 2) max = limit / 2;
+    if (max > room) max = room;
+    fs->mapped += max;
+
+    pthread_mutex_unlock(&fs->lock);
+
+    int ret = map_blocks(cl, file, fptr, max, size, offset, iov, count, bytes_read);
+
+    pthread_mutex_lock(&fs->lock);
+    fs->mapped -= max - *count;
+    pthread_mutex_unlock(&fs->lock);
+
+    return ret;
+}
+
+int fs_map_file(client_t *cl, unsigned file, size_t size, size_t offset, struct iovec *iov, unsigned *count, size_t *bytes_read)
+{
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, file));
+
+    lock_block(cl, file);
+
+    int ret = map_file(cl, file, fptr, size, offset, iov, count, bytes_read);
+
+    unlock_block(cl, file);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return ret;
+}
+
+void fs_unmap_file(client_t *cl, const struct iovec *iov, unsigned count)
+{
+    unpin_iov(cl, iov, count);
+
+    pthread_mutex_lock(&cl->fs->lock);
+    cl->fs->mapped -= count;
+    pthread_mutex_unlock(&cl->fs->lock);
+}
+
+static int truncate_file(client_t *cl, fs_file_t *fptr, uint64_t size)
+{
+    unsigned new_block_count;
+
+    if (size > FILE_MAX_SIZE) return -FSERR_OVERFLOW;
+
+    if (fptr->inlined && size <= FILE_INLINE_MAX)
+    {
+        if (size < fptr->size) memset(inline_data(fptr) + size, 0, fptr->size - size);
+        fptr->size = size;
+        cache_dirty_ptr(cl->dir_cache, fptr);
+        return 0;
+    }
+
+    if (fptr->inlined)
+    {
+        int ret = uninline_file(cl, fptr);
+        if (ret != 0) return ret;
+    }
+
+    if (size % BLOCK_SIZE == 0)
+    {
+        new_block_count = size / BLOCK_SIZE;
+    }
+    else
+    {
+        new_block_count = size / BLOCK_SIZE + 1;
+    }
+
+    int ret;
+
+    // growing only moves the end of the file, leaving a hole behind it
+    if (new_block_count < fptr->block_count)
+    {
+        ret = shrink_file(cl, fptr, new_block_count);
+        if (ret != 0) return ret;
+    }
+
+    // the rest of a block cut short must read as zeros should the file grow
+    if (size < fptr->size && size % BLOCK_SIZE != 0)
+    {
+        unsigned block_id;
+
+        ret = file_block(cl, fptr, size / BLOCK_SIZE, &block_id);
+        if (ret != 0) return ret;
+
+        if (block_id != 0)
+        {
+            unsigned char *block = verify_ptr(cache_pin_blk(cl->reg_cache, block_id));
+            memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+            cache_dirty_ptr(cl->reg_cache, block);
+            cache_unpin_ptr(cl->reg_cache, block);
+        }
+    }
+
+    fptr->block_count = new_block_count;
+
+    // An emptied file starts over inline, as files are mostly rewritten
+    // from scratch
+    if (fptr->block_count == 0 && size == 0)
+    {
+        memset(inline_data(fptr), 0, FILE_INLINE_MAX);
+        fptr->inlined = 1;
+    }
+
+    fptr->size = size;
+    cache_dirty_ptr(cl->dir_cache, fptr);
+
+    return 0;
+}
+
+int fs_truncate_file(client_t *cl, unsigned id, uint64_t size)
+{
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    lock_block(cl, id);
+
+    int ret = truncate_file(cl, fptr, size);
+
+    unlock_block(cl, id);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return ret;
+}
+
+// Copies what does not line up with whole blocks, through the client
+static int copy_bytes(client_t *cl, fs_file_t *sptr, fs_file_t *dptr, uint64_t src_off, uint64_t dst_off, uint64_t len, uint64_t *copied)
+{
+    if (len == 0) return 0;
+
+    char *buf = malloc(COPY_CHUNK);
+    if (buf == NULL) return -FSERR_OOM;
+
+    int ret = 0;
+
+    while (ret == 0 && len != 0)
+    {
+        size_t n = len < COPY_CHUNK ? len : COPY_CHUNK;
+        size_t bytes_read;
+        size_t bytes_written;
+
+        ret = read_file(cl, sptr, buf, n, src_off, &bytes_read);
+        if (ret != 0 || bytes_read == 0) break;
+
+        ret = write_file(cl, dptr, copy_buf, buf, bytes_read, dst_off, &bytes_written);
+
+        src_off += bytes_written;
+        dst_off += bytes_written;
+        len     -= bytes_written;
+        *copied += bytes_written;
+    }
+
+    free(buf);
+
+    return ret;
+}
+
+static int copy_batch(client_t *cl, const blk_id_t *src, const blk_id_t *dst, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+    {
+        // the server copies what it has, so newer cached data goes out first
+        if (cache_flush_blk(cl->reg_cache, src[i]) != 0) return -FSERR_IO;
+
+        cache_forget_blk(cl->reg_cache, dst[i]);
+    }
+
+    return client_cp_blks(cl, src, dst, n) != 0 ? -FSERR_IO : 0;
+}
+
+// Has the server copy count blocks from src_lblk on to dst_lblk on. Holes
+// stay holes, unless the destination already has a block there.
+static int copy_blocks(client_t *cl, fs_file_t *sptr, fs_file_t *dptr, unsigned src_lblk, unsigned dst_lblk, unsigned count)
+{
+    blk_id_t src[CLIENT_RD_BATCH];
+    blk_id_t dst[CLIENT_RD_BATCH];
+    unsigned n = 0;
+    int ret = 0;
+
+    for (unsigned i = 0; ret == 0 && i < count; i++)
+    {
+        unsigned src_id;
+        unsigned dst_id;
+
+        ret = file_block(cl, sptr, src_lblk + i, &src_id);
+        if (ret == 0) ret = file_block(cl, dptr, dst_lblk + i, &dst_id);
+        if (ret != 0) break;
+
+        if (src_id == 0)
+        {
+            if (dst_id == 0) continue;
+
+            unsigned char *block = cache_pin_claim(cl->reg_cache, dst_id);
+            if (block == NULL) return -FSERR_IO;
+
+            memset(block, 0, BLOCK_SIZE);
+            cache_dirty_ptr(cl->reg_cache, block);
+            cache_unpin_ptr(cl->reg_cache, block);
+            continue;
+        }
+
+        if (dst_id == 0)
+        {
+            unsigned run;
+
+            ret = fill_hole(cl, dptr, dst_lblk + i, count - i, &run);
+            if (ret == 0) ret = file_block(cl, dptr, dst_lblk + i, &dst_id);
+            if (ret != 0) break;
+        }
+
+        src[n] = src_id;
+        dst[n] = dst_id;
+
+        if (++n == CLIENT_RD_BATCH)
+        {
+            ret = copy_batch(cl, src, dst, n);
+            n = 0;
+        }
+    }
+
+    if (ret == 0 && n != 0) ret = copy_batch(cl, src, dst, n);
+
+    return ret;
+}
+
+// Where both offsets sit at the same place in a block, the whole blocks in
+// between are copied by the server and never pass through the client. A tail
+// ending the source goes along as a whole block when nothing of the
+// destination lies past it, since the rest of the block is zeros.
+static int copy_file(client_t *cl, fs_file_t *sptr, uint64_t src_off, fs_file_t *dptr, uint64_t dst_off, uint64_t len, uint64_t *copied)
+{
+    *copied = 0;
+
+    if (src_off >= sptr->size) return 0;
+    if (len > sptr->size - src_off) len = sptr->size - src_off;
+    if (dst_off > FILE_MAX_SIZE || len > FILE_MAX_SIZE - dst_off) return -FSERR_OVERFLOW;
+
+    if (sptr->inlined || src_off % BLOCK_SIZE != dst_off % BLOCK_SIZE)
+    {
+        return copy_bytes(cl, sptr, dptr, src_off, dst_off, len, copied);
+    }
+
+    uint64_t head = (BLOCK_SIZE - src_off % BLOCK_SIZE) % BLOCK_SIZE;
+    if (head > len) head = len;
+
+    int ret = copy_bytes(cl, sptr, dptr, src_off, dst_off, head, copied);
+    if (ret != 0 || *copied != head) return ret;
+
+    uint64_t rest   = len - head;
+    unsigned blocks = rest / BLOCK_SIZE;
+    uint64_t span   = (uint64_t)blocks * BLOCK_SIZE;
+    uint64_t tail   = rest - span;
+
+    if (tail != 0 && src_off + len == sptr->size && dst_off + len >= dptr->size)
+    {
+        blocks++;
+        span = rest;
+        tail = 0;
+    }
+
+    src_off += head;
+    dst_off += head;
+
+    if (blocks != 0)
+    {
+        if (dptr->inlined)
+        {
+            ret = uninline_file(cl, dptr);
+            if (ret != 0) return ret;
+        }
+
+        ret = copy_blocks(cl, sptr, dptr, src_off / BLOCK_SIZE, dst_off / BLOCK_SIZE, blocks);
+        if (ret != 0) return ret;
+
+        if (dst_off + span > dptr->size) dptr->size = dst_off + span;
+        if (dptr->size > (uint64_t)dptr->block_count * BLOCK_SIZE)
+        {
+            dptr->block_count = (dptr->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+
+        cache_dirty_ptr(cl->dir_cache, dptr);
+        *copied += span;
+    }
+
+    return copy_bytes(cl, sptr, dptr, src_off + span, dst_off + span, tail, copied);
+}
+
+int fs_copy_file(client_t *cl, unsigned src, uint64_t src_off, unsigned dst, uint64_t dst_off, uint64_t len, uint64_t *copied)
+{
+    *copied = 0;
+
+    if (src == dst && src_off < dst_off + len && dst_off < src_off + len) return -FSERR_INVAL;
+
+    fs_file_t *sptr = cache_pin_blk(cl->dir_cache, src);
+    fs_file_t *dptr = cache_pin_blk(cl->dir_cache, dst);
+    int ret = -FSERR_IO;
+
+    if (sptr != NULL && dptr != NULL)
+    {
+        lock_pair(cl, src, dst);
+
+        ret = copy_file(cl, sptr, src_off, dptr, dst_off, len, copied);
+
+        unlock_pair(cl, src, dst);
+    }
+
+    if (dptr != NULL) cache_unpin_ptr(cl->dir_cache, dptr);
+    if (sptr != NULL) cache_unpin_ptr(cl->dir_cache, sptr);
+
+    return ret;
+}
+
+unsigned fs_get_root(client_t *cl)
+{
+    return cl->fs->root;
+}
+
+int fs_get_file_size(client_t *cl, unsigned id, uint64_t *size)
+{
+    fs_file_t *file = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+    *size = file->size;
+    cache_unpin_ptr(cl->dir_cache, file);
+    return 0;
+}
+
+// Directories and files keep their parent at the same place
+int fs_get_parent(client_t *cl, unsigned id, unsigned *parent)
+{
+    fs_file_t *file = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+    *parent = file->parent;
+    cache_unpin_ptr(cl->dir_cache, file);
+    return 0;
+}
+
+void fs_set_time_policy(client_t *cl, unsigned atime, time_t lazy_expire)
+{
+    cl->fs->atime       = atime;
+    cl->fs->lazy_expire = lazy_expire;
+}
+
+// The lazy table is only looked at under fs->lock, and the times it holds
+// back are moved into the inode under the same lock
+static fs_lazy_t *lazy_find(fs_info_t *fs, unsigned id)
+{
+    for (unsigned i = 0; fs->lazy_count != 0 && i < FS_LAZY_SLOTS; i++)
+    {
+        if (fs->lazy[i].id == id) return &fs->lazy[i];
+    }
+
+    return NULL;
+}
+
+static void lazy_take(fs_info_t *fs, fs_lazy_t *lazy, fs_file_t *fptr)
+{
+    fptr->acc = lazy->acc;
+    fptr->mod = lazy->mod;
+
+    lazy->id = 0;
+    fs->lazy_count--;
+}
+
+static int lazy_apply(client_t *cl, unsigned id)
+{
+    fs_info_t *fs = cl->fs;
+
+    // directories and files share the timestamp layout
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    lock_block(cl, id);
+    pthread_mutex_lock(&fs->lock);
+
+    // the inode may have been written or freed in the meantime
+    fs_lazy_t *lazy = lazy_find(fs, id);
+    if (lazy != NULL) lazy_take(fs, lazy, fptr);
+
+    pthread_mutex_unlock(&fs->lock);
+
+    if (lazy != NULL) cache_dirty_ptr(cl->dir_cache, fptr);
+
+    unlock_block(cl, id);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return 0;
+}
+
+static fs_lazy_t *lazy_slot(fs_info_t *fs)
+{
+    for (unsigned i = 0; i < FS_LAZY_SLOTS; i++)
+    {
+        if (fs->lazy[i].id == 0) return &fs->lazy[i];
+    }
+
+    return NULL;
+}
+
+// Timestamps go straight into a block that is written back anyway, and are
+// otherwise held in the lazy table for up to lazy_expire seconds. They also go
+// straight in while the table is full, as writing out another inode's times
+// would mean taking its lock with this one held.
+static int store_times(client_t *cl, unsigned id, fs_file_t *fptr, const struct timespec *acc, const struct timespec *mod)
+{
+    fs_info_t *fs = cl->fs;
+    int now = fs->lazy_expire == 0 || cache_is_dirty(cl->dir_cache, fptr);
+
+    pthread_mutex_lock(&fs->lock);
+
+    fs_lazy_t *lazy = lazy_find(fs, id);
+
+    if (lazy == NULL && !now)
+    {
+        lazy = lazy_slot(fs);
+        now  = lazy == NULL;
+
+        if (lazy != NULL)
+        {
+            lazy->id    = id;
+            lazy->since = time(NULL);
+            fs->lazy_count++;
+        }
+    }
+
+    if (now)
+    {
+        if (lazy != NULL) lazy_take(fs, lazy, fptr);
+
+        fptr->acc = *acc;
+        fptr->mod = *mod;
+    }
+    else
+    {
+        lazy->acc = *acc;
+        lazy->mod = *mod;
+    }
+
+    pthread_mutex_unlock(&fs->lock);
+
+    if (now) cache_dirty_ptr(cl->dir_cache, fptr);
+
+    return 0;
+}
+
+static void get_times(fs_info_t *fs, unsigned id, const fs_file_t *fptr, struct timespec *acc, struct timespec *mod)
+{
+    pthread_mutex_lock(&fs->lock);
+
+    fs_lazy_t *lazy = lazy_find(fs, id);
+
+    *acc = lazy != NULL ? lazy->acc : fptr->acc;
+    *mod = lazy != NULL ? lazy->mod : fptr->mod;
+
+    pthread_mutex_unlock(&fs->lock);
+}
+
+// Returns 1 if the times changed, 0 if the atime policy left them alone
+static int touch(client_t *cl, unsigned id, fs_file_t *fptr, unsigned what)
+{
+    fs_info_t *fs = cl->fs;
+    struct timespec acc;
+    struct timespec mod;
+    struct timespec now;
+
+    get_times(fs, id, fptr, &acc, &mod);
+    timespec_get(&now, TIME_UTC);
+
+    if (!(what & FS_TOUCH_MOD))
+    {
+        if (fs->atime == FS_ATIME_NOATIME) return 0;
+
+        // like Linux: only when the access time would otherwise fall behind
+        // the modification, or has not moved in a day
+        int behind = acc.tv_sec < mod.tv_sec || (acc.tv_sec == mod.tv_sec && acc.tv_nsec <= mod.tv_nsec);
+
+        if (fs->atime == FS_ATIME_RELATIME && !behind && now.tv_sec - acc.tv_sec < FS_RELATIME_SEC) return 0;
+    }
+
+    acc = now;
+    if (what & FS_TOUCH_MOD) mod = now;
+
+    int ret = store_times(cl, id, fptr, &acc, &mod);
+
+    return ret != 0 ? ret : 1;
+}
+
+int fs_touch(client_t *cl, unsigned id, unsigned what)
+{
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    lock_block(cl, id);
+
+    int ret = touch(cl, id, fptr, what);
+
+    unlock_block(cl, id);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return ret;
+}
+
+// Times set on purpose are written right away
+static int set_times(client_t *cl, unsigned id, fs_file_t *fptr, const struct timespec *acc, const struct timespec *mod)
+{
+    fs_info_t *fs = cl->fs;
+
+    pthread_mutex_lock(&fs->lock);
+
+    fs_lazy_t *lazy = lazy_find(fs, id);
+    if (lazy != NULL) lazy_take(fs, lazy, fptr);
+
+    if (acc != NULL) fptr->acc = *acc;
+    if (mod != NULL) fptr->mod = *mod;
+
+    pthread_mutex_unlock(&fs->lock);
+
+    cache_dirty_ptr(cl->dir_cache, fptr);
+
+    return 0;
+}
+
+int fs_set_times(client_t *cl, unsigned id, const struct timespec *acc, const struct timespec *mod)
+{
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    lock_block(cl, id);
+
+    int ret = set_times(cl, id, fptr, acc, mod);
+
+    unlock_block(cl, id);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return ret;
+}
+
+int fs_get_times(client_t *cl, unsigned id, struct timespec *acc, struct timespec *mod)
+{
+    fs_file_t *fptr = verify_ptr(cache_pin_blk(cl->dir_cache, id));
+
+    get_times(cl->fs, id, fptr, acc, mod);
+
+    cache_unpin_ptr(cl->dir_cache, fptr);
+
+    return 0;
+}
+
+// Writes out the timestamps held back for lazy_expire seconds, or all of them
+int fs_flush_times(client_t *cl, int all)
+{
+    fs_info_t *fs = cl->fs;
+    time_t before = time(NULL) - fs->lazy_expire;
+
+    for (unsigned i = 0; i < FS_LAZY_SLOTS; i++)
+    {
+        pthread_mutex_lock(&fs->lock);
+
+        fs_lazy_t *lazy = &fs->lazy[i];
+        unsigned count  = fs->lazy_count;
+        unsigned id     = all || lazy->since <= before ? lazy->id : 0;
+
+        pthread_mutex_unlock(&fs->lock);
+
+        if (count == 0) break;
+        if (id == 0) continue;
+
+        int ret = lazy_apply(cl, id);
+        if (ret != 0) return ret;
+    }
+
+    return 0;
+}
+
+// Lets the server drop the data of freed blocks. The metadata that freed them
+// goes out first, so no block is trimmed while the server still has it in use.
+// Metadata that is pinned may still be in the middle of that change, so the
+// runs wait for a flush that leaves none of it dirty. The allocator stays
+// locked from that flush until the runs are sent, so that no block is freed
+// without its metadata going out first, or taken again before it is trimmed;
+// a first flush without the lock does most of the writing.
+static int flush_trim(client_t *cl)
+{
+    fs_info_t *fs = cl->fs;
+    blk_id_t start[FS_TRIM_BATCH];
+    blk_id_t count[FS_TRIM_BATCH];
+    unsigned id = fs->first;
+    int ret = 0;
+
+    if (fs->trim_count == 0) return 0;
+
+    if (cache_pinned_dirty(cl->sb_cache) || cache_pinned_dirty(cl->dir_cache)) return 0;
+
+    if (cache_flush(cl->sb_cache) != 0 || cache_flush(cl->dir_cache) != 0) return -FSERR_IO;
+
+    while (fs->trim_count != 0)
+    {
+        unsigned n = 0;
+
+        // the runs are taken off the map as they are batched, so a failed
+        // round trip leaves their data in place rather than retrying forever
+        while (n < FS_TRIM_BATCH && fs->trim_count != 0 && id < fs->total_count)
+        {
+            if (fs->trim_map[id / 8] == 0)
+            {
+                id = (id / 8 + 1) * 8;
+                continue;
             }
-            else
+
+            if (!(fs->trim_map[id / 8] & (1 << (id % 8))))
             {
-                int ret = fs_dump_dir(cl, entry->id, idt + 1);
-                if (ret != 0) return ret;
+                id++;
+                continue;
             }
+
+            start[n] = id;
+
+            while (id < fs->total_count && (fs->trim_map[id / 8] & (1 << (id % 8))))
+            {
+                fs->trim_map[id / 8] &= ~(1 << (id % 8));
+                fs->trim_count--;
+                id++;
+            }
+
+            count[n] = id - start[n];
+            n++;
         }
+
+        if (n == 0) break;
+
+        if (client_trim_blks(cl, start, count, n) != 0) ret = -FSERR_IO;
     }
 
-    return 0;
+    return ret;
+}
+
+int fs_flush_trim(client_t *cl)
+{
+    fs_info_t *fs = cl->fs;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    unsigned pending = fs->trim_count;
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if (pending == 0) return 0;
+
+    if (cache_flush(cl->sb_cache) != 0 || cache_flush(cl->dir_cache) != 0) return -FSERR_IO;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+
+    int ret = flush_trim(cl);
+
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    return ret;
+}
+
+static int fs_dump_dir(client_t *cl, unsigned dir, unsigned idt);
+
+typedef struct {
+    client_t *cl;
+    unsigned  idt;
+} dump_ctx_t;
+
+static int dump_entry(void *ctx, const fs_dir_entry_t *entry, uint64_t cookie)
+{
+    dump_ctx_t *dump = ctx;
+
+    indent(dump->idt);
+    printf("%s, block=%d, type=%s\n",
+        entry->name,
+        entry->id,
+        entry->type == FS_DIR ? "dir" : "file");
+    if (entry->type == FS_FILE)
+    {
+        fs_file_t *file_ptr = verify_ptr(cache_pin_blk(dump->cl->dir_cache, entry->id));
+        if (file_ptr->inlined)
+        {
+            indent(dump->idt + 1);
+            printf("inline: %lu bytes\n", (unsigned long)file_ptr->size);
+        }
+        for (unsigned j = 0; j < file_ptr->extent_count; j++)
+        {
+            fs_extent_t *ext = &file_ptr->extents[j];
+            indent(dump->idt + 1);
+            printf("%d: %d+%d\n", ext->lblk, ext->start, ext->len);
+        }
+
+        cache_unpin_ptr(dump->cl->dir_cache, file_ptr);
+
+        return 0;
+    }
+
+    return fs_dump_dir(dump->cl, entry->id, dump->idt + 1);
+}
+
+static int fs_dump_dir(client_t *cl, unsigned dir, unsigned idt)
+{
+    fs_dir_t *dir_ptr = verify_ptr(cache_pin_blk(cl->dir_cache, dir));
+
+    dump_ctx_t dump = { cl, idt };
+    int ret = dir_walk(cl, dir_ptr, 0, dump_entry, &dump);
+
+    cache_unpin_ptr(cl->dir_cache, dir_ptr);
+
+    return ret;
 }
 
 int fs_dump(client_t *cl)
 {
-    fs_super_t *super = verify_ptr(cache_get_blk(cl->sb_cache, SUPER_ID));
     log("file system dump:\n");
     printf("root\n");
-    return fs_dump_dir(cl, super->root, 0);
+    return fs_dump_dir(cl, cl->fs->root, 0);
 }
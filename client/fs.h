@@ -1,18 +1,38 @@
 #ifndef FS_H
 #define FS_H
 
+#include <pthread.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/uio.h>
 #include "blk.h"
 #include "cache.h"
+#include "dcache.h"
 
 #define BLOCK_SIZE      BLK_DATA_LEN
 #define NAME_MAX_LEN    16
-#define DIR_MAX_ENTRIES ((BLOCK_SIZE - sizeof(fs_dir_t)) / sizeof(fs_dir_entry_t))
-#define FILE_MAX_BLOCKS ((BLOCK_SIZE - sizeof(fs_file_t)) / sizeof(unsigned))
-#define FILE_MAX_SIZE   (BLOCK_SIZE * FILE_MAX_BLOCKS)
+#define DIR_INLINE_ENTRIES ((BLOCK_SIZE - sizeof(fs_dir_t)) / sizeof(fs_dir_entry_t))
+#define DIR_TABLE_MAX      ((BLOCK_SIZE - sizeof(fs_dir_t)) / sizeof(unsigned))
+#define BUCKET_MAX_ENTRIES ((BLOCK_SIZE - sizeof(fs_bucket_t)) / sizeof(fs_dir_entry_t))
+#define FILE_ROOT_EXTENTS ((BLOCK_SIZE - sizeof(fs_file_t)) / sizeof(fs_extent_t))
+#define FILE_INLINE_MAX   (BLOCK_SIZE - sizeof(fs_file_t))
+#define NODE_MAX_ENTRIES  ((BLOCK_SIZE - sizeof(fs_node_t)) / sizeof(fs_extent_t))
+#define FILE_MAX_SIZE     ((uint64_t) UINT32_MAX * BLOCK_SIZE)
+#define FS_LOCK_SLOTS     64
+#define FS_LAZY_SLOTS     128
+#define FS_TRIM_BATCH     64
+#define FS_FREE_SLOTS     1024
+#define FS_REF_MIN        1024
+#define FS_RELATIME_SEC   (24 * 60 * 60)
+
+// fs_touch: FS_TOUCH_MOD updates the access time along with the modification time
+#define FS_TOUCH_ACC      1u
+#define FS_TOUCH_MOD      2u
 
 enum fs_block_type { FS_FILE, FS_DIR, };
 
+enum fs_atime { FS_ATIME_RELATIME, FS_ATIME_STRICT, FS_ATIME_NOATIME, };
+
 enum fs_error {
     FSERR_OK = 0,
     FSERR_NOT_FOUND,
@@ -21,7 +41,10 @@ enum fs_error {
     FSERR_OOM,
     FSERR_LONG_NAME,
     FSERR_IO,
-    FSERR_OVERFLOW
+    FSERR_OVERFLOW,
+    FSERR_EXISTS,
+    FSERR_INVAL,
+    FSERR_NOT_EMPTY
 };
 
 typedef struct {
@@ -31,46 +54,154 @@ typedef struct {
     unsigned map_count;
 } fs_super_t;
 
+// Timestamps held back from their inode block under lazytime, id 0 when free
+typedef struct {
+    unsigned        id;
+    time_t          since;
+    struct timespec acc;
+    struct timespec mod;
+} fs_lazy_t;
+
+// Lookups of an inode the kernel has not forgotten yet, id 0 when free.
+// An orphan has been unlinked, and is freed once the count drops to zero.
+typedef struct {
+    unsigned        id;
+    unsigned char   orphan;
+    unsigned char   type;
+    uint64_t        nlookup;
+} fs_ref_t;
+
+// In-memory allocation state, rebuilt from the bitmap on mount
+typedef struct fs_info {
+    unsigned  first;
+    unsigned  total_count;
+    unsigned  root;
+    // the allocator: everything from here to trim_map, and the superblock
+    pthread_mutex_t alloc_lock;
+    unsigned  free_count;
+    unsigned  cursor;
+    unsigned  map_count;
+    unsigned *map_free;
+    // freed blocks still marked in the bitmap
+    unsigned        defer_count;
+    unsigned        defer[FS_FREE_SLOTS];
+    // freed blocks whose data the server may drop, one bit per id
+    unsigned        trim_count;
+    unsigned char  *trim_map;
+    dcache_t *dcache;
+    // renames across directories, see lock_rename
+    pthread_mutex_t rename_lock;
+    // guards the tables below, see lock_block for the rest
+    pthread_mutex_t lock;
+    // ids of the blocks locked by running operations
+    unsigned        locked[FS_LOCK_SLOTS];
+    pthread_cond_t  unlocked;
+    // when reads update access times, and how long timestamps may stay unwritten
+    unsigned        atime;
+    time_t          lazy_expire;
+    unsigned        lazy_count;
+    fs_lazy_t       lazy[FS_LAZY_SLOTS];
+    // data blocks pinned by reads still being replied to
+    unsigned        mapped;
+    // inodes known to the kernel, by id with linear probing
+    unsigned        ref_count;
+    unsigned        ref_mask;
+    fs_ref_t       *refs;
+} fs_info_t;
+
 typedef struct {
-    unsigned used;
     unsigned type;
     char     name[NAME_MAX_LEN];
     unsigned id;
 } fs_dir_entry_t;
 
-
+// Small directories keep their entries inline. Once those fill up, the
+// entries area holds a table of 2^table_bits bucket ids instead, indexed by
+// the top bits of the name hash.
 typedef struct {
+    unsigned          type;
     unsigned          parent;
-    unsigned          entry_id;
     struct timespec   acc;
     struct timespec   mod;
     struct timespec   crt;
     unsigned          entry_count;
+    unsigned          hashed;
+    unsigned          table_bits;
     fs_dir_entry_t    entries[];
 } fs_dir_t;
 
 typedef struct {
+    unsigned          depth;
+    unsigned          count;
+    fs_dir_entry_t    entries[];
+} fs_bucket_t;
+
+typedef struct {
+    unsigned lblk;
+    unsigned start;
+    unsigned len;
+} fs_extent_t;
+
+typedef struct {
+    unsigned          depth;
+    unsigned          count;
+    fs_extent_t       entries[];
+} fs_node_t;
+
+typedef struct {
+    unsigned          type;
     unsigned          parent;
-    unsigned          entry_id;
     struct timespec   acc;
     struct timespec   mod;
     struct timespec   crt;
-    unsigned          size;
+    uint64_t          size;
     unsigned          block_count;
-    unsigned          blocks[];
+    unsigned          depth;
+    unsigned          extent_count;
+    unsigned          inlined;      // the data itself is kept where extents[] would be
+    fs_extent_t       extents[];
 } fs_file_t;
 
+// Called for each entry in cookie order; a non-zero return stops the walk
+typedef int (*fs_dir_filler_t)(void *ctx, const fs_dir_entry_t *entry, uint64_t cookie);
+
+// Fills dst, a cached block, with len bytes found at pos in the source
+typedef int (*fs_copy_t)(void *ctx, void *dst, size_t pos, size_t len);
+
 int fs_init(client_t *cl, unsigned max_blocks);
+int fs_mount(client_t *cl);
+void fs_unmount(client_t *cl);
+int fs_get_usage(client_t *cl, unsigned *total, unsigned *free_count);
 int fs_find_block(client_t *cl, unsigned root, const char *path, unsigned *id, unsigned *type);
+int fs_lookup(client_t *cl, unsigned dir, const char *name, unsigned *id, unsigned *type);
+int fs_get_type(client_t *cl, unsigned id, unsigned *type);
+void fs_prefetch(client_t *cl, const unsigned *ids, unsigned count);
 int fs_create_dir(client_t *cl, unsigned dir, const char *name, unsigned *id);
 int fs_create_file(client_t *cl, unsigned dir, const char *name, unsigned *id);
 int fs_delete_block(client_t *cl, unsigned dir);
 int fs_write_file(client_t *cl, unsigned file, const char *buf, size_t size, size_t offset, size_t *bytes_written);
+int fs_write_file_from(client_t *cl, unsigned file, fs_copy_t copy, void *ctx, size_t size, size_t offset, size_t *bytes_written);
 int fs_read_file(client_t *cl, unsigned file, char *buf, size_t size, size_t offset, size_t *bytes_read);
-int fs_get_file_size(client_t *cl, unsigned id, unsigned *size);
-int fs_truncate_file(client_t *cl, unsigned id, unsigned size);
-int fs_delete_dir(client_t *cl, unsigned id);
-int fs_delete_file(client_t *cl, unsigned id);
+int fs_map_file(client_t *cl, unsigned file, size_t size, size_t offset, struct iovec *iov, unsigned *count, size_t *bytes_read);
+void fs_unmap_file(client_t *cl, const struct iovec *iov, unsigned count);
+int fs_get_file_size(client_t *cl, unsigned id, uint64_t *size);
+int fs_get_parent(client_t *cl, unsigned id, unsigned *parent);
+int fs_truncate_file(client_t *cl, unsigned id, uint64_t size);
+int fs_copy_file(client_t *cl, unsigned src, uint64_t src_off, unsigned dst, uint64_t dst_off, uint64_t len, uint64_t *copied);
+int fs_read_dir(client_t *cl, unsigned dir, uint64_t offset, fs_dir_filler_t fn, void *ctx);
+int fs_delete_dir(client_t *cl, unsigned dir, const char *name);
+int fs_delete_file(client_t *cl, unsigned dir, const char *name);
+int fs_rename(client_t *cl, unsigned dir, const char *name, unsigned new_dir, const char *new_name);
+int fs_ref(client_t *cl, unsigned id);
+int fs_forget(client_t *cl, unsigned id, uint64_t nlookup);
+int fs_free_orphans(client_t *cl);
+void fs_set_time_policy(client_t *cl, unsigned atime, time_t lazy_expire);
+int fs_touch(client_t *cl, unsigned id, unsigned what);
+int fs_set_times(client_t *cl, unsigned id, const struct timespec *acc, const struct timespec *mod);
+int fs_get_times(client_t *cl, unsigned id, struct timespec *acc, struct timespec *mod);
+int fs_flush_times(client_t *cl, int all);
+int fs_flush_free(client_t *cl);
+int fs_flush_trim(client_t *cl);
 int fs_dump(client_t *cl);
 unsigned fs_get_root(client_t *cl);
 
@@ -0,0 +1,27 @@
+#ifndef IOCTL_H
+#define IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define FS_CLONE_PATH_MAX	1024
+
+/*
+ * Issued on the destination file to copy a range of another file into it.
+ * FUSE passes no file descriptors along, so the source is named by its path
+ * from the root of the mount. Whole blocks that line up are copied by the
+ * server without passing through the client. The copy stops short at the
+ * end of the source, and copied comes back with the number of bytes copied.
+ */
+struct fs_clone_range
+{
+	uint64_t	src_offset;
+	uint64_t	src_length;
+	uint64_t	dest_offset;
+	uint64_t	copied;
+	char		src_path[FS_CLONE_PATH_MAX];
+};
+
+#define FS_IOC_CLONE_RANGE	_IOWR('c', 1, struct fs_clone_range)
+
+#endif
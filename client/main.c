@@ -2,11 +2,14 @@
 #include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
 #include <time.h>
 #include <unistd.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <sodium.h>
 #include <blk.h>
 #include <err.h>
@@ -14,12 +17,21 @@
 #include "cache.h"
 #include "client.h"
 #include "fs.h"
+#include "ioctl.h"
 
 static struct options
 {
 	const char *host;
 	const char *root;
 	const char *pass;
+	int pcache;
+	unsigned long cache;
+	const char *cache_split;
+	int writeback;
+	unsigned long wb_expire;
+	const char *dirty_ratio;
+	const char *atime;
+	unsigned long lazytime;
 } options;
 
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
@@ -28,10 +40,44 @@ static const struct fuse_opt option_spec[] =
 	OPTION("--host=%s", host),
 	OPTION("--root=%s", root),
 	OPTION("--pass=%s", pass),
+	OPTION("--pcache", pcache),
+	OPTION("--cache=%lu", cache),
+	OPTION("--cache-split=%s", cache_split),
+	OPTION("--wb-expire=%lu", wb_expire),
+	OPTION("--dirty-ratio=%s", dirty_ratio),
+	OPTION("--atime=%s", atime),
+	OPTION("--lazytime=%lu", lazytime),
+	{ "--no-writeback", offsetof(struct options, writeback), 0 },
 	FUSE_OPT_END
 };
 #undef OPTION
 
+static const char *const atime_modes[] =
+{
+	[FS_ATIME_RELATIME]	= "relatime",
+	[FS_ATIME_STRICT]	= "strict",
+	[FS_ATIME_NOATIME]	= "noatime",
+};
+
+#define N_ATIME_MODES (sizeof(atime_modes) / sizeof(*atime_modes))
+
+#define CTL_NAME    ".cachectl"
+#define CTL_INO     2
+#define CTL_MAX_LEN 128
+
+// how long the kernel may trust names and attributes it has been given.
+// Everything but the timestamps we update on our own changes through the
+// kernel, and those are invalidated through the notify queue.
+#define FS_TIMEOUT  60.0
+
+#define NOTIFY_QUEUE_LEN 256
+
+// most blocks one read may pin, a misaligned 128 KiB read spans 33
+#define READ_MAP_MAX 64
+
+// most entries of one readdir reply whose blocks are prefetched
+#define READDIR_PREFETCH 128
+
 static void usage(const char *name)
 {
     fprintf(stdout,
@@ -41,7 +87,28 @@ static void usage(const char *name)
             "    --host=<addr>      Connect to server at address <addr> (default: 127.0.0.1).\n"
             "    --root=<dir>       Use directory <dir> for local files (default: ./cl_root/).\n"
             "    --pass=<password>  Choose / specify password (default: empty string).\n"
+            "    --pcache           Keep a persistent block cache in the local directory.\n"
+            "    --cache=<KiB>      Total memory for the block caches (default: 1024).\n"
+            "    --cache-split=<sb>:<dir>:<reg>\n"
+            "                       Share the cache memory between superblock/bitmap,\n"
+            "                       metadata and data blocks (default: 10:30:60).\n"
+            "    --no-writeback     Flush dirty blocks on every close instead of in the\n"
+            "                       background.\n"
+            "    --wb-expire=<sec>  Write back blocks dirty for this long (default: 5).\n"
+            "    --dirty-ratio=<bg>:<max>\n"
+            "                       Percentage of a cache that may be dirty before the\n"
+            "                       background write-back is woken up, and before writers\n"
+            "                       have to write back themselves (default: 25:50).\n"
+            "    --atime=<mode>     When reads update access times: strict, relatime\n"
+            "                       or noatime (default: relatime).\n"
+            "    --lazytime=<sec>   Keep timestamp updates in memory for up to this long\n"
+            "                       before writing them out (default: 0, off).\n"
             "    --help             Display this help message.\n"
+            "\n"
+            "The cache sizes can be read and changed at run time through the\n"
+            "file /" CTL_NAME " in the mount, one '<cache> <KiB>' line per cache.\n"
+            "Files are copied on the server by the FS_IOC_CLONE_RANGE ioctl in\n"
+            "client/ioctl.h.\n"
             "\n",
             name);
 
@@ -50,444 +117,946 @@ static void usage(const char *name)
 
 static client_t cl;
 
-static int fs_getattr(const char *path, struct stat *stbuf)
+// Callbacks run in parallel on libfuse's worker threads. The fs locks the
+// inodes each call works on, and the caches lock themselves, so nothing here
+// takes a lock around a call. Whatever a reply points at must stay put while
+// it is copied into the kernel, which pinned cache blocks and private buffers
+// do.
+
+// Kernel state is invalidated from a thread of its own. A notification sent
+// from a callback can wait on the kernel, which may be waiting on that very
+// callback to return.
+static struct
 {
-    unsigned root, id, type;
-    int res;
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    pthread_t         thread;
+    struct fuse_chan *ch;
+    int               run;
+    unsigned          head;
+    unsigned          count;
+    struct
+    {
+        fuse_ino_t ino;
+        off_t      off;
+    } queue[NOTIFY_QUEUE_LEN];
+} notify = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+// An off of -1 drops the cached attributes, 0 drops the pages as well
+static void notify_inode(fuse_ino_t ino, off_t off)
+{
+    pthread_mutex_lock(&notify.lock);
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
+    unsigned i;
 
-    if (type == FS_DIR)
+    for (i = 0; i < notify.count; i++)
     {
-        fs_dir_t *d = cache_get_blk(cl.dir_cache, id);
-        if (d == NULL) return -EIO;
+        unsigned slot = (notify.head + i) % NOTIFY_QUEUE_LEN;
 
-        stbuf->st_mode  = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        stbuf->st_mtim  = d->mod;
-        stbuf->st_atim  = d->acc;
+        if (notify.queue[slot].ino == ino)
+        {
+            if (off == 0) notify.queue[slot].off = 0;
+            break;
+        }
     }
-    else
+
+    // a full queue loses the notification, FS_TIMEOUT still bounds the damage
+    if (notify.run && i == notify.count && notify.count < NOTIFY_QUEUE_LEN)
     {
-        fs_file_t *f = cache_get_blk(cl.dir_cache, id);
-        if (f == NULL) return -EIO;
+        unsigned slot = (notify.head + notify.count) % NOTIFY_QUEUE_LEN;
 
-        stbuf->st_mode  = S_IFREG | 0777;
-        stbuf->st_nlink = 1;
-        stbuf->st_size  = f->size;
-        stbuf->st_mtim  = f->mod;
-        stbuf->st_atim  = f->acc;
+        notify.queue[slot].ino = ino;
+        notify.queue[slot].off = off;
+        notify.count++;
+
+        pthread_cond_signal(&notify.cond);
     }
 
-	return 0;
+    pthread_mutex_unlock(&notify.lock);
 }
 
-static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			off_t offset, struct fuse_file_info *fi)
+static void *notify_loop(void *arg)
 {
-    unsigned root, id, type;
-    int res;
-
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    (void)arg;
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
-    if (type == -FS_FILE) return -ENOTDIR;
+    pthread_mutex_lock(&notify.lock);
 
-    fs_dir_t *dir = cache_get_blk(cl.dir_cache, id);
-    if (dir == 0) return -EIO;
-
-    for (unsigned i = 0; i < DIR_MAX_ENTRIES; i++)
+    while (notify.run)
     {
-        fs_dir_entry_t *entry = &dir->entries[i];
-        if (entry->used)
+        if (notify.count == 0)
         {
-            filler(buf, entry->name, NULL, 0);
+            pthread_cond_wait(&notify.cond, &notify.lock);
+            continue;
         }
+
+        fuse_ino_t ino = notify.queue[notify.head].ino;
+        off_t      off = notify.queue[notify.head].off;
+
+        notify.head = (notify.head + 1) % NOTIFY_QUEUE_LEN;
+        notify.count--;
+
+        pthread_mutex_unlock(&notify.lock);
+
+        // fails harmlessly for inodes the kernel has already forgotten
+        fuse_lowlevel_notify_inval_inode(notify.ch, ino, off, 0);
+
+        pthread_mutex_lock(&notify.lock);
+    }
+
+    pthread_mutex_unlock(&notify.lock);
+
+    return NULL;
+}
+
+static int notify_start(void)
+{
+    notify.run = 1;
+
+    if (pthread_create(&notify.thread, NULL, notify_loop, NULL) != 0)
+    {
+        notify.run = 0;
+        return -1;
     }
 
     return 0;
 }
 
-static int fs_open(const char *path, struct fuse_file_info *fi)
+static void notify_stop(void)
 {
-    log("%s, path=%s\n", __func__, path);
+    pthread_mutex_lock(&notify.lock);
 
-    unsigned root, id, type;
-    int res;
+    int run = notify.run;
+
+    notify.run = 0;
+    pthread_cond_signal(&notify.cond);
+
+    pthread_mutex_unlock(&notify.lock);
+
+    if (run) pthread_join(notify.thread, NULL);
+}
+
+static const struct
+{
+    const char *name;
+    cache_t   **cache;
+} ctl_caches[] =
+{
+    { "sb_cache",  &cl.sb_cache  },
+    { "dir_cache", &cl.dir_cache },
+    { "reg_cache", &cl.reg_cache },
+};
+
+#define CTL_N_CACHES (sizeof(ctl_caches) / sizeof(*ctl_caches))
+
+static int ctl_format(char *buf)
+{
+    int len = 0;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    for (unsigned i = 0; i < CTL_N_CACHES; i++)
+    {
+        len += snprintf(buf + len, CTL_MAX_LEN - len, "%s %zu\n",
+                        ctl_caches[i].name,
+                        cache_size(*ctl_caches[i].cache) / 1024);
+    }
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
-    if (type == -FS_DIR) return -EISDIR;
+    return len;
+}
 
-	return 0;
+static int ctl_read(char *buf, size_t size, off_t offset)
+{
+    char ctl[CTL_MAX_LEN];
+    int  len = ctl_format(ctl);
+
+    if (offset >= len) return 0;
+    if (size > len - offset) size = len - offset;
+
+    memcpy(buf, ctl + offset, size);
+
+    return size;
 }
 
-static int split_path(const char *path, char *lbuf, char *rbuf)
+static int ctl_write(const char *buf, size_t size, off_t offset)
 {
-    unsigned len = strlen(path);
-    unsigned split_id;
-    const char *split = NULL;
+    char ctl[CTL_MAX_LEN];
+    char *line, *save;
+
+    if (offset != 0 || size >= CTL_MAX_LEN) return -EINVAL;
 
-    for (unsigned i = len - 1; i >= 0; i--)
+    memcpy(ctl, buf, size);
+    ctl[size] = '\0';
+
+    for (line = strtok_r(ctl, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
     {
-        if (path[i] == '/')
+        char name[16];
+        size_t kib;
+        unsigned i;
+
+        if (sscanf(line, "%15s %zu", name, &kib) != 2) return -EINVAL;
+
+        for (i = 0; i < CTL_N_CACHES; i++)
         {
-            split_id = i + 1;
-            split    = path + split_id;
-            break;
+            if (strcmp(name, ctl_caches[i].name) == 0) break;
+        }
+
+        if (i == CTL_N_CACHES) return -EINVAL;
+
+        if (cache_resize(*ctl_caches[i].cache, cache_n_blk(kib * 1024)) != 0)
+        {
+            return errno == EBUSY || errno == ENOMEM ? -errno : -EIO;
         }
+
+        log("%s resized to %zu KiB\n", name, cache_size(*ctl_caches[i].cache) / 1024);
     }
 
-    if (split)
+    return size;
+}
+
+/*
+ * Inode numbers are block ids, except that the root directory is presented
+ * as FUSE_ROOT_ID. Blocks below the first data block never hold an inode, so
+ * the control file can borrow one of their ids.
+ */
+
+static unsigned ino_id(fuse_ino_t ino)
+{
+    return ino == FUSE_ROOT_ID ? fs_get_root(&cl) : ino;
+}
+
+static fuse_ino_t id_ino(unsigned id)
+{
+    return id == fs_get_root(&cl) ? FUSE_ROOT_ID : id;
+}
+
+static int ctl_entry(fuse_ino_t parent, const char *name)
+{
+    return parent == FUSE_ROOT_ID && strcmp(name, CTL_NAME) == 0;
+}
+
+static int fill_attr(fuse_ino_t ino, struct stat *stbuf)
+{
+    unsigned id, type;
+
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_ino = ino;
+
+    if (ino == CTL_INO)
     {
-        memcpy(lbuf, path, split_id);
-        lbuf[split_id] = '\0';
-        memcpy(rbuf, path + split_id, len - split_id);
-        rbuf[len - split_id] = '\0';
-        return 1;
+        char ctl[CTL_MAX_LEN];
+
+        stbuf->st_mode  = S_IFREG | 0600;
+        stbuf->st_nlink = 1;
+        stbuf->st_size  = ctl_format(ctl);
+        return 0;
     }
-    else return 0;
+
+    id = ino_id(ino);
+    if (id == 0) return EIO;
+
+    int res = fs_get_type(&cl, id, &type);
+    if (res == -FSERR_NOT_FOUND) return ENOENT;
+    if (res != 0) return EIO;
+
+    if (type == FS_DIR)
+    {
+        stbuf->st_mode  = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    }
+    else
+    {
+        uint64_t size;
+
+        if (fs_get_file_size(&cl, id, &size) != 0) return EIO;
+
+        stbuf->st_mode  = S_IFREG | 0777;
+        stbuf->st_nlink = 1;
+        stbuf->st_size  = size;
+    }
+
+    // under lazytime the latest times may not be in the block yet
+    if (fs_get_times(&cl, id, &stbuf->st_atim, &stbuf->st_mtim) != 0) return EIO;
+
+    return 0;
 }
 
-static int fs_mkdir(const char *path, mode_t mode)
+// Every entry handed to the kernel is a lookup it will forget later
+static int fill_entry(struct fuse_entry_param *e, unsigned id)
 {
-    (void)mode;
-    log("%s, path=%s\n", __func__, path);
+    memset(e, 0, sizeof(*e));
+    e->ino           = id_ino(id);
+    e->attr_timeout  = FS_TIMEOUT;
+    e->entry_timeout = FS_TIMEOUT;
+
+    int res = fill_attr(e->ino, &e->attr);
+    if (res != 0) return res;
 
-    unsigned root, id, type;
+    if (e->ino != FUSE_ROOT_ID && fs_ref(&cl, id) != 0) return ENOMEM;
+
+    return 0;
+}
+
+static void fs_lookup_ll(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    unsigned id, type;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    if (ctl_entry(parent, name))
+    {
+        memset(&e, 0, sizeof(e));
+        e.ino = CTL_INO;
+        fill_attr(CTL_INO, &e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_IO) return -EIO;
-    if (res != -FSERR_NOT_FOUND) return -EEXIST;
+    res = fs_lookup(&cl, ino_id(parent), name, &id, &type);
+    if (res == -FSERR_NOT_FOUND)
+    {
+        // a zero ino caches the miss in the kernel
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = FS_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
 
-    char lbuf[64];
-    char rbuf[64];
+    res = fill_entry(&e, id);
+    if (res != 0) { fuse_reply_err(req, res); return; }
 
-    if (!split_path(path, lbuf, rbuf)) return -ENOENT;
+    fuse_reply_entry(req, &e);
+}
 
-    unsigned pid;
-    res = fs_find_block(&cl, root, lbuf, &pid, &type);
-    if (res == -FSERR_IO) return -EIO;
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (type == FS_FILE) return -EISDIR;
+static void fs_forget_ll(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    // an unlinked inode is freed once the kernel lets go of it
+    if (ino != FUSE_ROOT_ID && ino != CTL_INO && fs_forget(&cl, ino_id(ino), nlookup) != 0)
+    {
+        log("%s, could not free ino=%lu\n", __func__, (unsigned long)ino);
+    }
+
+    fuse_reply_none(req);
+}
+
+static void fs_getattr_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+    int res;
+
+    (void)fi;
+
+    res = fill_attr(ino, &stbuf);
+    if (res != 0) { fuse_reply_err(req, res); return; }
+
+    fuse_reply_attr(req, &stbuf, FS_TIMEOUT);
+}
+
+static void fs_setattr_ll(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			int to_set, struct fuse_file_info *fi)
+{
+    log("%s, ino=%lu\n", __func__, (unsigned long)ino);
+
+    struct stat stbuf;
+    unsigned id = ino_id(ino);
+    int res;
+
+    (void)fi;
+
+    if (ino != CTL_INO && (to_set & FUSE_SET_ATTR_SIZE))
+    {
+        if (client_throttle(&cl) != 0) { fuse_reply_err(req, EIO); return; }
+
+        res = fs_truncate_file(&cl, id, attr->st_size);
+        if (res == -FSERR_IO) { fuse_reply_err(req, EIO); return; }
+        if (res == -FSERR_OOM) { fuse_reply_err(req, ENOMEM); return; }
+        if (res == -FSERR_OVERFLOW) { fuse_reply_err(req, EFBIG); return; }
 
-    res = fs_create_dir(&cl, pid, rbuf, &id);
-    if (res == -FSERR_IO) return -EIO;
-    if (res == -FSERR_LONG_NAME) return -ENAMETOOLONG;
-    if (res == -FSERR_OOM || res == -FSERR_FULL_DIR) return -ENOMEM;
+        if (fs_touch(&cl, id, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
+    }
+
+    if (ino != CTL_INO && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+    {
+        res = fs_set_times(&cl, id,
+                           to_set & FUSE_SET_ATTR_ATIME ? &attr->st_atim : NULL,
+                           to_set & FUSE_SET_ATTR_MTIME ? &attr->st_mtim : NULL);
+        if (res != 0) { fuse_reply_err(req, EIO); return; }
+    }
+
+    res = fill_attr(ino, &stbuf);
+    if (res != 0) { fuse_reply_err(req, res); return; }
+
+    fuse_reply_attr(req, &stbuf, FS_TIMEOUT);
+}
+
+typedef struct {
+    fuse_req_t  req;
+    char       *buf;
+    size_t      size;
+    size_t      len;
+    unsigned    ids[READDIR_PREFETCH];
+    unsigned    n_ids;
+} fill_ctx_t;
+
+// The cookie is handed back as the offset to resume from
+static int fill_dirent(void *ctx, const fs_dir_entry_t *entry, uint64_t cookie)
+{
+    fill_ctx_t *fill = ctx;
+    struct stat stbuf;
 
-    fs_dir_t *dir = cache_get_blk(cl.dir_cache, id);
-    if (dir == NULL) return -EIO;
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino  = id_ino(entry->id);
+    stbuf.st_mode = entry->type == FS_DIR ? S_IFDIR : S_IFREG;
 
-    struct timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    dir->acc = ts;
-    dir->mod = ts;
+    size_t len = fuse_add_direntry(fill->req, NULL, 0, entry->name, NULL, 0);
+    if (fill->len + len > fill->size) return 1;
 
-    dir = cache_get_blk(cl.dir_cache, pid);
-    if (dir == NULL) return -EIO;
-    dir->acc = ts;
-    dir->mod = ts;
+    fuse_add_direntry(fill->req, fill->buf + fill->len, fill->size - fill->len,
+                      entry->name, &stbuf, cookie);
+    fill->len += len;
+
+    if (fill->n_ids < READDIR_PREFETCH) fill->ids[fill->n_ids++] = entry->id;
 
     return 0;
 }
 
-static int fs_create(const char *path, mode_t mode, struct fuse_file_info *info)
+static void fs_readdir_ll(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t offset, struct fuse_file_info *fi)
 {
-    (void)info;
-    (void)mode;
+    unsigned type;
+    int res;
+
+    (void)fi;
+
+    res = fs_get_type(&cl, ino_id(ino), &type);
+    if (res == -FSERR_NOT_FOUND) { fuse_reply_err(req, ENOENT); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
+    if (type == FS_FILE) { fuse_reply_err(req, ENOTDIR); return; }
+
+    fill_ctx_t fill = { req, malloc(size), size, 0 };
+    if (fill.buf == NULL) { fuse_reply_err(req, ENOMEM); return; }
+
+    res = fs_read_dir(&cl, ino_id(ino), offset, fill_dirent, &fill);
+
+    if (res != 0) fuse_reply_err(req, EIO);
+    else fuse_reply_buf(req, fill.buf, fill.len);
 
-    log("%s, path=%s\n", __func__, path);
+    // ls -l and friends look every entry up next, have the blocks ready by
+    // then. The reply is already out, so this only holds up the next request.
+    if (res == 0) fs_prefetch(&cl, fill.ids, fill.n_ids);
 
-    unsigned root, id, type;
+    free(fill.buf);
+}
+
+static void fs_open_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    log("%s, ino=%lu\n", __func__, (unsigned long)ino);
+
+    unsigned type;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    if (ino == CTL_INO)
+    {
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+        return;
+    }
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_IO) return -EIO;
-    if (res != -FSERR_NOT_FOUND) return -EEXIST;
+    res = fs_get_type(&cl, ino_id(ino), &type);
+    if (res == -FSERR_NOT_FOUND) { fuse_reply_err(req, ENOENT); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
+    if (type == FS_DIR) { fuse_reply_err(req, EISDIR); return; }
 
-    char lbuf[64];
-    char rbuf[64];
+    // all writes pass through the kernel, so its pages stay good across opens
+    fi->keep_cache = 1;
 
-    if (!split_path(path, lbuf, rbuf)) return -ENOENT;
+    fuse_reply_open(req, fi);
+}
 
-    unsigned pid;
-    res = fs_find_block(&cl, root, lbuf, &pid, &type);
-    if (res == -FSERR_IO) return -EIO;
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (type == FS_FILE) return -EISDIR;
+static void fs_mkdir_ll(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    if (client_throttle(&cl) != 0) { fuse_reply_err(req, EIO); return; }
 
-    res = fs_create_file(&cl, pid, rbuf, &id);
-    if (res == -FSERR_IO) return -EIO;
-    if (res == -FSERR_LONG_NAME) return -ENAMETOOLONG;
-    if (res == -FSERR_OOM || res == -FSERR_FULL_DIR) return -ENOMEM;
+    (void)mode;
+    log("%s, name=%s\n", __func__, name);
+
+    struct fuse_entry_param e;
+    unsigned pid, id;
+    int res;
 
-    fs_file_t *file= cache_get_blk(cl.dir_cache, id);
-    if (file == NULL) return -EIO;
+    if (ctl_entry(parent, name)) { fuse_reply_err(req, EEXIST); return; }
 
-    struct timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    file->acc = ts;
-    file->mod = ts;
+    pid = ino_id(parent);
 
-    fs_dir_t *dir = cache_get_blk(cl.dir_cache, pid);
-    if (dir == NULL) return -EIO;
+    res = fs_create_dir(&cl, pid, name, &id);
+    if (res == -FSERR_IO) { fuse_reply_err(req, EIO); return; }
+    if (res == -FSERR_EXISTS) { fuse_reply_err(req, EEXIST); return; }
+    if (res == -FSERR_LONG_NAME) { fuse_reply_err(req, ENAMETOOLONG); return; }
+    if (res == -FSERR_OOM || res == -FSERR_FULL_DIR) { fuse_reply_err(req, ENOMEM); return; }
 
-    dir->acc = ts;
-    dir->mod = ts;
+    if (fs_touch(&cl, id, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
+    if (fs_touch(&cl, pid, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
 
-    return 0;
+    // the id may have belonged to something the kernel still remembers
+    notify_inode(id_ino(id), 0);
+
+    res = fill_entry(&e, id);
+    if (res != 0) { fuse_reply_err(req, res); return; }
+
+    fuse_reply_entry(req, &e);
 }
 
-static int fs_truncate(const char *path, off_t length)
+static void fs_create_ll(fuse_req_t req, fuse_ino_t parent, const char *name,
+			mode_t mode, struct fuse_file_info *fi)
 {
-    log("%s, path=%s\n", __func__, path);
+    if (client_throttle(&cl) != 0) { fuse_reply_err(req, EIO); return; }
+
+    (void)mode;
 
-    unsigned root, file_id, type;
+    log("%s, name=%s\n", __func__, name);
+
+    struct fuse_entry_param e;
+    unsigned pid, id;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    if (ctl_entry(parent, name)) { fuse_reply_err(req, EEXIST); return; }
+
+    pid = ino_id(parent);
+
+    res = fs_create_file(&cl, pid, name, &id);
+    if (res == -FSERR_IO) { fuse_reply_err(req, EIO); return; }
+    if (res == -FSERR_EXISTS) { fuse_reply_err(req, EEXIST); return; }
+    if (res == -FSERR_LONG_NAME) { fuse_reply_err(req, ENAMETOOLONG); return; }
+    if (res == -FSERR_OOM || res == -FSERR_FULL_DIR) { fuse_reply_err(req, ENOMEM); return; }
 
-    res = fs_find_block(&cl, root, path, &file_id, &type);
-    if (res == -FSERR_IO) return -EIO;
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (type == FS_DIR) return -EISDIR;
+    if (fs_touch(&cl, id, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
+    if (fs_touch(&cl, pid, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
 
-    res = fs_truncate_file(&cl, file_id, length);
-    if (res == -FSERR_IO) return -EIO;
-    if (res == -FSERR_OOM) return -ENOMEM;
+    notify_inode(id_ino(id), 0);
 
-    fs_file_t *file= cache_get_blk(cl.dir_cache, file_id);
-    if (file == NULL) return -EIO;
+    res = fill_entry(&e, id);
+    if (res != 0) { fuse_reply_err(req, res); return; }
 
-    timespec_get(&file->mod, TIME_UTC);
-    file->acc = file->mod;
+    fi->keep_cache = 1;
 
-	return 0;
+    fuse_reply_create(req, &e, fi);
 }
 
-static int fs_read(const char *path, char *buf, size_t size,
+// Replies with the data behind iov without gathering it into one buffer
+static void reply_iov(fuse_req_t req, const struct iovec *iov, unsigned count)
+{
+    if (count == 0) { fuse_reply_buf(req, NULL, 0); return; }
+
+    struct fuse_bufvec *bufv = malloc(sizeof(*bufv) + (count - 1) * sizeof(bufv->buf[0]));
+    if (bufv == NULL) { fuse_reply_err(req, ENOMEM); return; }
+
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = count;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        bufv->buf[i] = bufv->buf[0];
+        bufv->buf[i].size = iov[i].iov_len;
+        bufv->buf[i].mem = iov[i].iov_base;
+    }
+
+    fuse_reply_data(req, bufv, 0);
+    free(bufv);
+}
+
+static void fs_read_ll(fuse_req_t req, fuse_ino_t ino, size_t size,
 			off_t offset, struct fuse_file_info *fi)
 {
-    log("%s, path=%s\n", __func__, path);
+    log("%s, ino=%lu\n", __func__, (unsigned long)ino);
 
-    unsigned root, id, type;
+    unsigned id = ino_id(ino);
+    struct iovec iov[READ_MAP_MAX];
+    unsigned count = READ_MAP_MAX;
+    char *buf = NULL;
     size_t bread;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    (void)fi;
+
+    if (ino == CTL_INO)
+    {
+        buf = malloc(size);
+        if (buf == NULL) { fuse_reply_err(req, ENOMEM); return; }
+
+        fuse_reply_buf(req, buf, ctl_read(buf, size, offset));
+        free(buf);
+        return;
+    }
+
+    // the cached blocks go to the kernel as they are, only a read that
+    // cannot be pinned all at once is copied out
+    if (fs_map_file(&cl, id, size, offset, iov, &count, &bread) != 0)
+    {
+        count = 0;
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
-    if (type == -FS_DIR) return -EISDIR;
+        buf = malloc(size);
+        if (buf == NULL) { fuse_reply_err(req, ENOMEM); return; }
 
-    res = fs_read_file(&cl, id, buf, size, offset, &bread);
-    if (res == -FSERR_IO) return -EIO;
+        res = fs_read_file(&cl, id, buf, size, offset, &bread);
+        if (res < 0) { fuse_reply_err(req, EIO); goto out; }
+    }
 
-    fs_file_t *file = cache_get_blk(cl.dir_cache, id);
-    if (file == NULL) return -EIO;
+    unsigned pid;
 
-    struct timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    file->acc = ts;
+    if (fs_get_parent(&cl, id, &pid) != 0) { fuse_reply_err(req, EIO); goto out; }
 
-    unsigned pid = file->parent;
-    fs_dir_t *parent = cache_get_blk(cl.dir_cache, pid);
-    if (parent == NULL) return -EIO;
+    if (fs_touch(&cl, id, FS_TOUCH_ACC) < 0) { fuse_reply_err(req, EIO); goto out; }
 
-    parent->acc = ts;
+    res = fs_touch(&cl, pid, FS_TOUCH_ACC);
+    if (res < 0) { fuse_reply_err(req, EIO); goto out; }
+    if (res > 0) notify_inode(id_ino(pid), -1);
 
-    return bread; // bon appetit
+    if (buf != NULL) fuse_reply_buf(req, buf, bread); // bon appetit
+    else reply_iov(req, iov, count);
+
+out:
+    fs_unmap_file(&cl, iov, count);
+    free(buf);
 }
 
-static int fs_write(const char *path, const char *buf, size_t size,
+// Hands the request data to write_file one block at a time. When libfuse
+// splices requests, it is read out of the pipe straight into the cache.
+static int copy_bufvec(void *ctx, void *dst, size_t pos, size_t len)
+{
+    struct fuse_bufvec *src = ctx;
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(len);
+
+    (void)pos; // the blocks are filled in order
+
+    out.buf[0].mem = dst;
+
+    return fuse_buf_copy(&out, src, 0) == (ssize_t)len ? 0 : -1;
+}
+
+static void fs_write_buf_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
 			off_t offset, struct fuse_file_info *fi)
 {
-    log("%s, path=%s\n", __func__, path);
+    if (client_throttle(&cl) != 0) { fuse_reply_err(req, EIO); return; }
+
+    log("%s, ino=%lu\n", __func__, (unsigned long)ino);
 
-    unsigned root, id, type;
+    unsigned id = ino_id(ino);
+    size_t size = fuse_buf_size(bufv);
     size_t bwrit;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    (void)fi;
+
+    if (ino == CTL_INO)
+    {
+        char buf[CTL_MAX_LEN];
+        struct fuse_bufvec out = FUSE_BUFVEC_INIT(sizeof(buf));
+
+        if (size >= CTL_MAX_LEN) { fuse_reply_err(req, EINVAL); return; }
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
-    if (type == -FS_DIR) return -EISDIR;
+        out.buf[0].mem = buf;
+        if (fuse_buf_copy(&out, bufv, 0) != (ssize_t)size) { fuse_reply_err(req, EIO); return; }
 
-    res = fs_write_file(&cl, id, buf, size, offset, &bwrit);
-    if (res == -FSERR_IO) return -EIO;
+        res = ctl_write(buf, size, offset);
+        if (res < 0) fuse_reply_err(req, -res);
+        else fuse_reply_write(req, res);
+        return;
+    }
 
-    fs_file_t *file = cache_get_blk(cl.dir_cache, id);
-    if (file == NULL) return -EIO;
+    // what a failed write got through is in the file, so it is a short write
+    res = fs_write_file_from(&cl, id, copy_bufvec, bufv, size, offset, &bwrit);
+    if (res == -FSERR_OOM && bwrit == 0) { fuse_reply_err(req, ENOSPC); return; }
+    if (res == -FSERR_OVERFLOW && bwrit == 0) { fuse_reply_err(req, EFBIG); return; }
+    if (res < 0 && bwrit == 0) { fuse_reply_err(req, EIO); return; }
 
-    struct timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    file->acc = ts;
-    file->mod = ts;
+    unsigned pid;
 
-    unsigned pid = file->parent;
+    if (fs_get_parent(&cl, id, &pid) != 0) { fuse_reply_err(req, EIO); return; }
 
-    fs_dir_t *dir = cache_get_blk(cl.dir_cache, pid);
-    if (dir == NULL) return -EIO;
+    if (fs_touch(&cl, id, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
 
-    dir->acc = ts;
-    dir->mod = ts;
+    res = fs_touch(&cl, pid, FS_TOUCH_MOD);
+    if (res < 0) { fuse_reply_err(req, EIO); return; }
+    if (res > 0) notify_inode(id_ino(pid), -1);
 
-    return bwrit;
+    fuse_reply_write(req, bwrit);
 }
 
-int fs_utimens(const char *path, const struct timespec specs[2])
+static void fs_rmdir_ll(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    log("%s, path=%s\n", __func__, path);
+    log("%s, name=%s\n", __func__, name);
 
-    unsigned root, id, type;
+    unsigned pid = ino_id(parent);
+    unsigned id, type;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    if (ctl_entry(parent, name)) { fuse_reply_err(req, ENOTDIR); return; }
+
+    res = fs_lookup(&cl, pid, name, &id, &type);
+    if (res == -FSERR_NOT_FOUND) { fuse_reply_err(req, ENOENT); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
+    if (type == FS_FILE) { fuse_reply_err(req, ENOTDIR); return; }
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
-    if (type == -FS_DIR) return -EISDIR;
+    if (fs_touch(&cl, pid, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
 
-    fs_file_t *file = cache_get_blk(cl.dir_cache, id);
-    if (file == NULL) return -EIO;
+    res = fs_delete_dir(&cl, pid, name);
+    if (res == -FSERR_NOT_EMPTY) { fuse_reply_err(req, ENOTEMPTY); return; }
+    if (res == -FSERR_IO) { fuse_reply_err(req, EIO); return; }
 
-    file->acc = specs[0];
-    file->mod = specs[1];
+    fuse_reply_err(req, 0);
+}
 
-    fs_dir_t *parent = cache_get_blk(cl.dir_cache, id);
-    if (parent == NULL) return -EIO;
+static void fs_unlink_ll(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    log("%s, name=%s\n", __func__, name);
 
-    parent->acc = specs[0];
-    parent->mod = specs[1];
+    unsigned pid = ino_id(parent);
+    unsigned id, type;
+    int res;
 
-    return 0;
+    if (ctl_entry(parent, name)) { fuse_reply_err(req, EPERM); return; }
+
+    res = fs_lookup(&cl, pid, name, &id, &type);
+    if (res == -FSERR_NOT_FOUND) { fuse_reply_err(req, ENOENT); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
+    if (type == FS_DIR) { fuse_reply_err(req, EISDIR); return; }
+
+    if (fs_touch(&cl, pid, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
+
+    res = fs_delete_file(&cl, pid, name);
+    if (res == -FSERR_IO) { fuse_reply_err(req, EIO); return; }
+
+    fuse_reply_err(req, 0);
 }
 
-static int fs_rmdir(const char *path)
+static void fs_rename_ll(fuse_req_t req, fuse_ino_t parent, const char *name,
+                         fuse_ino_t newparent, const char *newname)
 {
-    log("%s, path=%s\n", __func__, path);
+    log("%s, name=%s, newname=%s\n", __func__, name, newname);
 
-    unsigned root, id, type;
+    unsigned pid = ino_id(parent);
+    unsigned new_pid = ino_id(newparent);
+    unsigned id, type, new_id, new_type;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    if (ctl_entry(parent, name) || ctl_entry(newparent, newname)) { fuse_reply_err(req, EPERM); return; }
+
+    res = fs_lookup(&cl, pid, name, &id, &type);
+    if (res == -FSERR_NOT_FOUND) { fuse_reply_err(req, ENOENT); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
-    if (type == -FS_FILE) return -ENOTDIR;
+    res = fs_lookup(&cl, new_pid, newname, &new_id, &new_type);
+    if (res != 0 && res != -FSERR_NOT_FOUND) { fuse_reply_err(req, EIO); return; }
+    if (res == 0 && new_id != id && new_type != type)
+    {
+        fuse_reply_err(req, new_type == FS_DIR ? EISDIR : ENOTDIR);
+        return;
+    }
 
-    fs_dir_t *dir = cache_get_blk(cl.dir_cache, id);
-    if (dir == NULL) return -EIO;
-    unsigned pid = dir->parent;
+    if (fs_touch(&cl, pid, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
+    if (new_pid != pid && fs_touch(&cl, new_pid, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
 
-    fs_dir_t *parent = cache_get_blk(cl.dir_cache, pid);
-    if (parent == NULL) return -EIO;
+    res = fs_rename(&cl, pid, name, new_pid, newname);
+    if (res == -FSERR_NOT_FOUND) { fuse_reply_err(req, ENOENT); return; }
+    if (res == -FSERR_NOT_DIR) { fuse_reply_err(req, ENOTDIR); return; }
+    if (res == -FSERR_NOT_EMPTY) { fuse_reply_err(req, ENOTEMPTY); return; }
+    if (res == -FSERR_INVAL) { fuse_reply_err(req, EINVAL); return; }
+    if (res == -FSERR_LONG_NAME) { fuse_reply_err(req, ENAMETOOLONG); return; }
+    if (res == -FSERR_OOM || res == -FSERR_FULL_DIR) { fuse_reply_err(req, ENOSPC); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
 
-    struct timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    parent->mod = ts;
-    parent->acc = ts;
+    fuse_reply_err(req, 0);
+}
 
-    res = fs_delete_dir(&cl, id);
-    if (res == -FSERR_IO) return -EIO;
+static void fs_fsync_ll(fuse_req_t req, fuse_ino_t ino, int datasync,
+			struct fuse_file_info *fi)
+{
+    log("%s, ino=%lu\n", __func__, (unsigned long)ino);
 
-    return 0;
+    // just flush everything
+    (void)datasync;
+    (void)fi;
+
+    if (client_flush_all(&cl) != 0) { fuse_reply_err(req, EIO); return; }
+
+    fuse_reply_err(req, 0);
 }
 
-static int fs_unlink(const char *path)
+static void fs_ioctl_ll(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned flags,
+			const void *in_buf, size_t in_bufsz, size_t out_bufsz)
 {
-    log("%s, path=%s\n", __func__, path);
+    log("%s, ino=%lu\n", __func__, (unsigned long)ino);
 
-    unsigned root, id, type;
+    const struct fs_clone_range *range = in_buf;
+    struct fs_clone_range out;
+    unsigned id = ino_id(ino);
+    unsigned src, type;
+    uint64_t copied;
     int res;
 
-    root = fs_get_root(&cl);
-    if (root == 0) return -EIO;
+    (void)arg;
+    (void)fi;
 
-    res = fs_find_block(&cl, root, path, &id, &type);
-    if (res == -FSERR_NOT_FOUND) return -ENOENT;
-    if (res == -FSERR_IO) return -EIO;
-    if (type == -FS_DIR) return -EISDIR;
+    if (flags & FUSE_IOCTL_COMPAT) { fuse_reply_err(req, ENOSYS); return; }
+    if ((unsigned)cmd != FS_IOC_CLONE_RANGE) { fuse_reply_err(req, ENOTTY); return; }
+    if (in_bufsz != sizeof(*range) || out_bufsz != sizeof(out) || ino == CTL_INO) { fuse_reply_err(req, EINVAL); return; }
+    if (memchr(range->src_path, 0, sizeof(range->src_path)) == NULL) { fuse_reply_err(req, ENAMETOOLONG); return; }
 
-    fs_file_t *file = cache_get_blk(cl.dir_cache, id);
-    if (file == NULL) return -EIO;
-    unsigned pid = file->parent;
+    if (fs_get_type(&cl, id, &type) != 0) { fuse_reply_err(req, EIO); return; }
+    if (type != FS_FILE) { fuse_reply_err(req, EISDIR); return; }
 
-    fs_dir_t *parent = cache_get_blk(cl.dir_cache, pid);
-    if (parent == NULL) return -EIO;
+    res = fs_find_block(&cl, fs_get_root(&cl), range->src_path, &src, &type);
+    if (res == -FSERR_NOT_FOUND) { fuse_reply_err(req, ENOENT); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
+    if (type != FS_FILE) { fuse_reply_err(req, EISDIR); return; }
 
-    struct timespec ts;
-    timespec_get(&ts, TIME_UTC);
-    parent->mod = ts;
-    parent->acc = ts;
+    res = fs_copy_file(&cl, src, range->src_offset, id, range->dest_offset, range->src_length, &copied);
+    if (res == -FSERR_INVAL) { fuse_reply_err(req, EINVAL); return; }
+    if (res == -FSERR_OOM) { fuse_reply_err(req, ENOSPC); return; }
+    if (res == -FSERR_OVERFLOW) { fuse_reply_err(req, EFBIG); return; }
+    if (res != 0) { fuse_reply_err(req, EIO); return; }
 
-    res = fs_delete_file(&cl, id);
-    if (res == -FSERR_IO) return -EIO;
+    if (fs_touch(&cl, id, FS_TOUCH_MOD) < 0) { fuse_reply_err(req, EIO); return; }
 
-    return 0;
+    // the kernel may hold pages of the old contents
+    notify_inode(ino, 0);
+
+    out = *range;
+    out.copied = copied;
+
+    fuse_reply_ioctl(req, 0, &out, sizeof(out));
 }
 
-static int fs_flush(const char *path, struct fuse_file_info *info)
+static void fs_statfs_ll(fuse_req_t req, fuse_ino_t ino)
 {
-    log("%s, path=%s\n", __func__, path);
+    log("%s\n", __func__);
+
+    (void)ino;
+    struct statvfs st;
+    unsigned total;
+    unsigned free_count;
+
+    if (fs_get_usage(&cl, &total, &free_count) != 0) { fuse_reply_err(req, EIO); return; }
+
+    // every file and directory takes a block of its own
+    memset(&st, 0, sizeof(st));
+    st.f_bsize   = BLOCK_SIZE;
+    st.f_frsize  = BLOCK_SIZE;
+    st.f_blocks  = total;
+    st.f_bfree   = free_count;
+    st.f_bavail  = free_count;
+    st.f_files   = total;
+    st.f_ffree   = free_count;
+    st.f_favail  = free_count;
+    st.f_namemax = NAME_MAX_LEN - 1;
+
+    fuse_reply_statfs(req, &st);
+}
 
-    // just flush everything
-    (void)path;
-    (void)info;
-    unsigned res;
+static void fs_flush_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    // the write-back thread gets to the data on its own
+    if (options.writeback) { fuse_reply_err(req, 0); return; }
 
-    res = client_flush_all(&cl);
-    if (res != 0) return -EIO;
+    fs_fsync_ll(req, ino, 0, fi);
+}
 
-    return 0;
+static void fs_init_ll(void *userdata, struct fuse_conn_info *conn)
+{
+    (void)userdata;
+
+    // move file data through pipes instead of copying it, where the kernel can,
+    // and let writes through the page cache arrive in large requests
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_BIG_WRITES);
+
+    if (notify_start() != 0)
+    {
+        log("kernel caches will only expire on timeout\n");
+    }
+
+    // started here rather than in main, the session may fork into the background
+    if (options.writeback && client_start_writeback(&cl) != 0)
+    {
+        log("running without background write-back\n");
+        options.writeback = 0;
+    }
 }
 
-static struct fuse_operations fs_ops =
-{
-    .getattr    = fs_getattr,
-    .readdir    = fs_readdir,
-    .truncate   = fs_truncate,
-    .open       = fs_open,
-    .read       = fs_read,
-    .write      = fs_write,
-    .mkdir      = fs_mkdir,
-    .create     = fs_create,
-    .utimens    = fs_utimens,
-    .rmdir      = fs_rmdir,
-    .unlink     = fs_unlink,
-    .flush      = fs_flush,
+static struct fuse_lowlevel_ops fs_ops =
+{
+    .init       = fs_init_ll,
+    .lookup     = fs_lookup_ll,
+    .forget     = fs_forget_ll,
+    .getattr    = fs_getattr_ll,
+    .setattr    = fs_setattr_ll,
+    .readdir    = fs_readdir_ll,
+    .open       = fs_open_ll,
+    .read       = fs_read_ll,
+    .write_buf  = fs_write_buf_ll,
+    .mkdir      = fs_mkdir_ll,
+    .create     = fs_create_ll,
+    .rmdir      = fs_rmdir_ll,
+    .unlink     = fs_unlink_ll,
+    .rename     = fs_rename_ll,
+    .flush      = fs_flush_ll,
+    .fsync      = fs_fsync_ll,
+    .statfs     = fs_statfs_ll,
+    .ioctl      = fs_ioctl_ll,
 };
 
+static int fs_run(struct fuse_args *args)
+{
+	int			ret	= -1;
+	char *			mountpoint;
+	int			multithreaded;
+	int			foreground;
+	struct fuse_chan *	ch;
+	struct fuse_session *	se;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+		&foreground) != 0)
+	{
+		return -1;
+	}
+
+	ch = fuse_mount(mountpoint, args);
+
+	if (ch != NULL)
+	{
+		se = fuse_lowlevel_new(args, &fs_ops, sizeof(fs_ops), NULL);
+
+		if (se != NULL)
+		{
+			if (fuse_set_signal_handlers(se) == 0)
+			{
+				fuse_session_add_chan(se, ch);
+				notify.ch = ch;
+
+				if (fuse_daemonize(foreground) == 0)
+				{
+					ret = multithreaded ?
+						fuse_session_loop_mt(se) :
+						fuse_session_loop(se);
+				}
+
+				/* Notifications need the channel in the session */
+				notify_stop();
+
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+
+			fuse_session_destroy(se);
+		}
+
+		fuse_unmount(mountpoint, ch);
+	}
+
+	free(mountpoint);
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc == 1) usage(argv[0]);
@@ -495,20 +1064,68 @@ int main(int argc, char *argv[])
 
 	int			ret	= EXIT_SUCCESS;
 	struct fuse_args	args	= FUSE_ARGS_INIT(argc, argv);
+	client_opt_t		opt;
+	unsigned		atime;
 
 	options.host = try_ptr(ENOMEM, strdup, "127.0.0.1");
 	options.root = try_ptr(ENOMEM, strdup, "./cl_root/");
 	options.pass = try_ptr(ENOMEM, strdup, "");
+	options.cache = 1024;
+	options.cache_split = try_ptr(ENOMEM, strdup, "10:30:60");
+	options.writeback = 1;
+	options.wb_expire = 5;
+	options.dirty_ratio = try_ptr(ENOMEM, strdup, "25:50");
+	options.atime = try_ptr(ENOMEM, strdup, "relatime");
 
 	try_fn(0, fuse_opt_parse, &args, &options, option_spec, NULL);
-	try_fn(ENOMEM, fuse_opt_add_arg, &args, "-s");
 
-	try_fn(0, client_start, &cl, options.host, options.root, options.pass);
+	opt.pcache = options.pcache;
+	opt.cache_size = options.cache * 1024;
+
+	if (sscanf(options.cache_split, "%u:%u:%u",
+		&opt.sb_share, &opt.dir_share, &opt.reg_share) != 3)
+	{
+		fprintf(stderr, "error: invalid cache split: %s\n",
+			options.cache_split);
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	opt.wb_expire = options.wb_expire;
+
+	if (sscanf(options.dirty_ratio, "%u:%u",
+		&opt.dirty_bg, &opt.dirty_max) != 2)
+	{
+		fprintf(stderr, "error: invalid dirty ratio: %s\n",
+			options.dirty_ratio);
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	for (atime = 0; atime < N_ATIME_MODES; atime++)
+	{
+		if (strcmp(options.atime, atime_modes[atime]) == 0)
+		{
+			break;
+		}
+	}
+
+	if (atime == N_ATIME_MODES)
+	{
+		fprintf(stderr, "error: invalid atime mode: %s\n",
+			options.atime);
+		ret = EXIT_FAILURE;
+		goto exit;
+	}
+
+	try_fn(0, client_start, &cl, options.host, options.root, options.pass,
+		&opt);
+	fs_set_time_policy(&cl, atime, options.lazytime);
 	try_fn(0, client_flush_all, &cl);
 
 	log("client started\n");
 
-	ret = fuse_main(args.argc, args.argv, &fs_ops, NULL);
+	ret = fs_run(&args);
 
 	client_stop(&cl);
 
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <sodium.h>
+#include <blk.h>
+#include <err.h>
+#include <mtree.h>
+#include "client.h"
+#include "pcache.h"
+
+#define PCACHE_MAGIC	"pcache1"
+
+/*
+ * The persistent cache is a sparse file in the client root holding one slot
+ * per block id. Each slot stores the encrypted block as it was last seen on
+ * the wire, together with its leaf hash. A slot with an all-zero leaf hash is
+ * empty.
+ *
+ * The header records the top hash that every stored leaf belongs to. It is
+ * cleared while the cache is in use and written back on a clean close, so a
+ * crashed client or a tree that has moved on since the last close simply
+ * discards the whole file on the next mount.
+ *
+ * Slots are read and written without the client lock. Those users share
+ * pc_lock, and dropping the cache takes it exclusively, so the descriptor is
+ * never closed under a transfer still in flight.
+ */
+
+typedef struct
+{
+	char		magic[8];
+	hash_t		top;
+} pcache_hdr_t;
+
+typedef struct
+{
+	hash_t		leaf;
+	blk_t		blk;
+} pcache_ent_t;
+
+static inline off_t pcache_off(blk_id_t id)
+{
+	return sizeof(pcache_hdr_t) + (off_t) id * sizeof(pcache_ent_t);
+}
+
+/* Called without pc_lock held, another user may have dropped it already */
+static void pcache_drop(client_t *cl)
+{
+	pthread_rwlock_wrlock(&cl->pc_lock);
+
+	if (cl->pc_fd != -1)
+	{
+		log("persistent cache disabled\n");
+
+		if (ftruncate(cl->pc_fd, 0) != 0)
+		{
+			perror("error: ftruncate");
+		}
+
+		close(cl->pc_fd);
+		cl->pc_fd = -1;
+	}
+
+	pthread_rwlock_unlock(&cl->pc_lock);
+}
+
+int pcache_open(client_t *cl, const hash_t *top)
+{
+	int		ret	= 0;
+	int		flags	= O_RDWR | O_CREAT;
+	mode_t		mode	= 0600;
+	pcache_hdr_t	hdr;
+	ssize_t		len;
+
+	cl->pc_fd = try_fd(0, openat, cl->root_fd, "cache", flags, mode);
+
+	len = pread(cl->pc_fd, &hdr, sizeof(hdr), 0);
+
+	if (	len != sizeof(hdr)					||
+		memcmp(hdr.magic, PCACHE_MAGIC, sizeof(hdr.magic)) != 0	||
+		top == NULL						||
+		memcmp(hdr.top, *top, sizeof(hdr.top)) != 0		)
+	{
+		log("persistent cache is stale, discarding\n");
+
+		try_fn(0, ftruncate, cl->pc_fd, 0);
+	}
+
+	memcpy(hdr.magic, PCACHE_MAGIC, sizeof(hdr.magic));
+	memset(hdr.top, 0, sizeof(hdr.top));
+
+	try_io(0, pwrite, cl->pc_fd, &hdr, sizeof(hdr), 0);
+	try_fn(0, fdatasync, cl->pc_fd);
+
+exit:
+	return ret;
+}
+
+int pcache_close(client_t *cl, const hash_t *top)
+{
+	int		ret	= 0;
+	pcache_hdr_t	hdr;
+
+	if (cl->pc_fd == -1)
+	{
+		return ret;
+	}
+
+	memcpy(hdr.magic, PCACHE_MAGIC, sizeof(hdr.magic));
+	memcpy(hdr.top, *top, sizeof(hdr.top));
+
+	try_fn(0, fdatasync, cl->pc_fd);
+	try_io(0, pwrite, cl->pc_fd, &hdr, sizeof(hdr), 0);
+	try_fn(0, fdatasync, cl->pc_fd);
+
+exit:
+	pthread_rwlock_wrlock(&cl->pc_lock);
+	close(cl->pc_fd);
+	cl->pc_fd = -1;
+	pthread_rwlock_unlock(&cl->pc_lock);
+
+	return ret;
+}
+
+int pcache_get(client_t *cl, blk_t *blk, blk_id_t id)
+{
+	hash_t		leaf;
+	hash_t		hash;
+	struct iovec	iov[2];
+	ssize_t		len	= -1;
+
+	iov[0].iov_base	= leaf;
+	iov[0].iov_len	= sizeof(leaf);
+	iov[1].iov_base	= blk;
+	iov[1].iov_len	= sizeof*(blk);
+
+	pthread_rwlock_rdlock(&cl->pc_lock);
+
+	if (cl->pc_fd != -1)
+	{
+		len = preadv(cl->pc_fd, iov, 2, pcache_off(id));
+	}
+
+	pthread_rwlock_unlock(&cl->pc_lock);
+
+	if (len != sizeof(pcache_ent_t))
+	{
+		return -1;
+	}
+
+	if (sodium_is_zero((void *) leaf, sizeof(leaf)))
+	{
+		return -1;
+	}
+
+	crypto_generichash(	(void *)       hash, sizeof (hash),
+				(const void *) blk , sizeof*(blk) ,
+				NULL               , 0);
+
+	if (memcmp(hash, leaf, sizeof(hash)) != 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+int pcache_put(client_t *cl, const blk_t *blk, const hash_t *leaf,
+		blk_id_t id)
+{
+	struct iovec	iov[2];
+	ssize_t		len	= sizeof(pcache_ent_t);
+
+	iov[0].iov_base	= (void *) leaf;
+	iov[0].iov_len	= sizeof*(leaf);
+	iov[1].iov_base	= (void *) blk;
+	iov[1].iov_len	= sizeof*(blk);
+
+	pthread_rwlock_rdlock(&cl->pc_lock);
+
+	if (cl->pc_fd != -1)
+	{
+		len = pwritev(cl->pc_fd, iov, 2, pcache_off(id));
+	}
+
+	pthread_rwlock_unlock(&cl->pc_lock);
+
+	if (len != sizeof(pcache_ent_t))
+	{
+		/* The stale slot may still be in place and would verify */
+		perror("error: pwritev");
+		pcache_drop(cl);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Empty the slots of blocks that changed without their contents passing
+ * through the client, giving back the space if possible
+ */
+void pcache_trim(client_t *cl, blk_id_t id, blk_id_t count)
+{
+	static hash_t	null_leaf;
+	int		mode	= FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+	off_t		off	= pcache_off(id);
+	off_t		len	= pcache_off(id + count) - off;
+	int		failed	= 0;
+
+	pthread_rwlock_rdlock(&cl->pc_lock);
+
+	if (cl->pc_fd == -1 || fallocate(cl->pc_fd, mode, off, len) == 0)
+	{
+		pthread_rwlock_unlock(&cl->pc_lock);
+		return;
+	}
+
+	for (blk_id_t i = id; i != id + count && !failed; i++)
+	{
+		if (pwrite(cl->pc_fd, null_leaf, sizeof(null_leaf),
+				pcache_off(i)) != sizeof(null_leaf))
+		{
+			perror("error: pwrite");
+			failed = 1;
+		}
+	}
+
+	pthread_rwlock_unlock(&cl->pc_lock);
+
+	if (failed)
+	{
+		pcache_drop(cl);
+	}
+}
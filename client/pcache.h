@@ -0,0 +1,16 @@
+#ifndef PCACHE_H
+#define PCACHE_H
+
+#include <blk.h>
+#include <mtree.h>
+
+typedef struct client client_t;
+
+int	pcache_open	(client_t *cl, const hash_t *top);
+int	pcache_close	(client_t *cl, const hash_t *top);
+int	pcache_get	(client_t *cl, blk_t *blk, blk_id_t id);
+int	pcache_put	(client_t *cl, const blk_t *blk, const hash_t *leaf,
+			blk_id_t id);
+void	pcache_trim	(client_t *cl, blk_id_t id, blk_id_t count);
+
+#endif
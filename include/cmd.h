@@ -7,6 +7,8 @@ enum
 	CMD_NDAT,
 	CMD_WR_BLK,
 	CMD_RD_BLK,
+	CMD_TRIM,
+	CMD_CP_BLK,
 };
 
 typedef unsigned char cmd_t;
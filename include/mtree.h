@@ -28,6 +28,8 @@ void		mtree_rebuild		(mtree_t *mtree);
 void		mtree_update_node	(mtree_t *mtree, node_id_t node_id);
 void		mtree_set_blk		(mtree_t *mtree, node_id_t blk_id,
 					const blk_t *blk);
+void		mtree_set_leaf		(mtree_t *mtree, node_id_t blk_id,
+					const hash_t *hash);
 
 static inline node_id_t mtree_parent(node_id_t node_id)
 {
@@ -64,13 +64,22 @@ void mtree_update_node(mtree_t *mtree, node_id_t node_id)
 
 void mtree_set_blk(mtree_t *mtree, blk_id_t blk_id, const blk_t *blk)
 {
-	node_id_t	node_id		= mtree_blk(mtree, blk_id);
-	mtree_node_t (*	node)[1]	= (void *) &mtree->nodes[node_id];
+	hash_t		hash;
 
-	crypto_generichash(	      (void *) node, sizeof*(node),
+	crypto_generichash(	      (void *) hash, sizeof (hash),
 				(const void *) blk , sizeof*(blk ),
 				NULL, 0);
 
+	mtree_set_leaf(mtree, blk_id, &hash);
+}
+
+void mtree_set_leaf(mtree_t *mtree, blk_id_t blk_id, const hash_t *hash)
+{
+	node_id_t	node_id		= mtree_blk(mtree, blk_id);
+	mtree_node_t *	node		= &mtree->nodes[node_id];
+
+	memcpy(&node->hash, hash, sizeof*(hash));
+
 	if (node_id != 0)
 	{
 		mtree_update_node(mtree, mtree_parent(node_id));
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -57,11 +58,20 @@ static int server_rd_blk(server_t *sv)
 
 	log("read block %" PRIu64 "\n", id);
 
-	try_fd(0, lseek, sv->data_fd, id * sizeof(blk.data), SEEK_SET);
-	try_io(0, read, sv->data_fd, &blk.data, sizeof(blk.data));
+	/* A block that was never written, or was trimmed, is not on disk */
+	if (memcmp(&sv->mtree->nodes[mtree_blk(sv->mtree, id)],
+		sv->null_hash, sizeof(sv->null_hash)) == 0)
+	{
+		memset(&blk, 0, sizeof(blk));
+	}
+	else
+	{
+		try_fd(0, lseek, sv->data_fd, id * sizeof(blk.data), SEEK_SET);
+		try_io(0, read, sv->data_fd, &blk.data, sizeof(blk.data));
 
-	try_fd(0, lseek, sv->aead_fd, id * sizeof(blk.extr), SEEK_SET);
-	try_io(0, read, sv->aead_fd, &blk.extr, sizeof(blk.extr));
+		try_fd(0, lseek, sv->aead_fd, id * sizeof(blk.extr), SEEK_SET);
+		try_io(0, read, sv->aead_fd, &blk.extr, sizeof(blk.extr));
+	}
 
 	if (memcmp(&blk, &null_blk, sizeof(null_blk)) == 0)
 	{
@@ -109,6 +119,130 @@ exit:
 	return ret;
 }
 
+/* Give back the space behind len bytes at off, or zero them */
+static int punch(int fd, off_t off, off_t len)
+{
+	static const char	zero[BLK_DATA_LEN];
+	int			ret	= 0;
+	int			mode	= FALLOC_FL_PUNCH_HOLE |
+					  FALLOC_FL_KEEP_SIZE;
+
+	if (fallocate(fd, mode, off, len) == 0)
+	{
+		return 0;
+	}
+
+	if (errno != EOPNOTSUPP)
+	{
+		fail_fn(0, fallocate);
+	}
+
+	while (len != 0)
+	{
+		size_t n = len < sizeof(zero) ? len : sizeof(zero);
+
+		try_io(0, pwrite, fd, zero, n, off);
+
+		off += n;
+		len -= n;
+	}
+
+exit:
+	return ret;
+}
+
+/*
+ * Forget a range of freed blocks. Their leaves go back to the hash of an
+ * empty block, which reads without touching the disk, and a proof is sent
+ * for each block in turn as for a write.
+ */
+static int server_trim(server_t *sv)
+{
+	int		ret	= 0;
+	blk_id_t	n_blk	= mtree_nblk(sv->mtree);
+	blk_id_t	id;
+	blk_id_t	count;
+
+	try_io(0, recv, sv->sock_fd, &id, sizeof(id), MSG_WAITALL);
+	try_io(0, recv, sv->sock_fd, &count, sizeof(count), MSG_WAITALL);
+
+	log("trim blocks %" PRIu64 "+%" PRIu64 "\n", id, count);
+
+	if (id > n_blk || count > n_blk - id)
+	{
+		fail_fn(EINVAL, __func__);
+	}
+
+	try_fn(0, punch, sv->data_fd, id * BLK_DATA_LEN, count * BLK_DATA_LEN);
+	try_fn(0, punch, sv->aead_fd, id * BLK_EXTR_LEN, count * BLK_EXTR_LEN);
+
+	for (blk_id_t i = id; i != id + count; i++)
+	{
+		mtree_set_leaf(sv->mtree, i, &sv->null_hash);
+		try_fn(0, send_mtree, sv, i);
+	}
+
+exit:
+	return ret;
+}
+
+/*
+ * Copy a block as it is stored. Blocks carry no trace of their id, so the
+ * copy decrypts just as well, and its leaf is the leaf of the source. The
+ * source leaf is sent along with a proof that it is current, followed by
+ * the proof for the updated copy.
+ */
+static int server_cp_blk(server_t *sv)
+{
+	int		ret	= 0;
+	blk_id_t	n_blk	= mtree_nblk(sv->mtree);
+	blk_id_t	src;
+	blk_id_t	dst;
+	blk_t		blk;
+	hash_t		leaf;
+
+	try_io(0, recv, sv->sock_fd, &src, sizeof(src), MSG_WAITALL);
+	try_io(0, recv, sv->sock_fd, &dst, sizeof(dst), MSG_WAITALL);
+
+	log("copy block %" PRIu64 " to %" PRIu64 "\n", src, dst);
+
+	if (src >= n_blk || dst >= n_blk)
+	{
+		fail_fn(EINVAL, __func__);
+	}
+
+	memcpy(leaf, &sv->mtree->nodes[mtree_blk(sv->mtree, src)], sizeof(leaf));
+
+	if (memcmp(leaf, sv->null_hash, sizeof(leaf)) == 0)
+	{
+		try_fn(0, punch, sv->data_fd, dst * BLK_DATA_LEN, BLK_DATA_LEN);
+		try_fn(0, punch, sv->aead_fd, dst * BLK_EXTR_LEN, BLK_EXTR_LEN);
+	}
+	else
+	{
+		try_fd(0, lseek, sv->data_fd, src * sizeof(blk.data), SEEK_SET);
+		try_io(0, read, sv->data_fd, &blk.data, sizeof(blk.data));
+
+		try_fd(0, lseek, sv->aead_fd, src * sizeof(blk.extr), SEEK_SET);
+		try_io(0, read, sv->aead_fd, &blk.extr, sizeof(blk.extr));
+
+		try_fd(0, lseek, sv->data_fd, dst * sizeof(blk.data), SEEK_SET);
+		try_io(0, write, sv->data_fd, &blk.data, sizeof(blk.data));
+
+		try_fd(0, lseek, sv->aead_fd, dst * sizeof(blk.extr), SEEK_SET);
+		try_io(0, write, sv->aead_fd, &blk.extr, sizeof(blk.extr));
+	}
+
+	try_io(0, send, sv->sock_fd, leaf, sizeof(leaf), MSG_MORE);
+	try_fn(0, send_mtree, sv, src);
+
+	mtree_set_leaf(sv->mtree, dst, &leaf);
+	try_fn(0, send_mtree, sv, dst);
+
+exit:
+	return ret;
+}
+
 static void server_reset(server_t *sv)
 {
 	sv->sock_fd	= -1;
@@ -161,8 +295,6 @@ static int server_new_sys(server_t *sv)
 	mode_t		mode	= 0600;
 	node_id_t	nodes	= mtree_size_from_depth(MTREE_DEPTH);
 	blk_id_t	n_blk	= mtree_nblk_from_depth(MTREE_DEPTH);
-	blk_t		blk;
-	hash_t		hash;
 
 	sv->data_fd = try_fd(0, openat, sv->root_fd, "data", flags, mode);
 	try_fn(0, ftruncate, sv->data_fd, n_blk * BLK_DATA_LEN);
@@ -175,17 +307,12 @@ static int server_new_sys(server_t *sv)
 
 	sv->mtree = try_ptr(0, mtree_new, MTREE_DEPTH);
 
-	memset(&blk, 0, sizeof(blk));
-	crypto_generichash(	(void *) &hash, sizeof(hash),
-				(void *) &blk , sizeof(blk ),
-				NULL, 0);
-
 	for (blk_id_t blk_id = 0; blk_id != n_blk; blk_id++)
 	{
 		node_id_t	node_id	= mtree_blk(sv->mtree, blk_id);
 		mtree_node_t *	node	= &sv->mtree->nodes[node_id];
 
-		memcpy(&node->hash, &hash, sizeof(hash));
+		memcpy(&node->hash, &sv->null_hash, sizeof(sv->null_hash));
 	}
 
 	mtree_rebuild(sv->mtree);
@@ -199,9 +326,15 @@ int server_start(server_t *sv, int sock_fd, const char *root_path)
 	int		ret	= 0;
 	node_id_t	nodes	= mtree_size_from_depth(MTREE_DEPTH);
 	struct stat	statbuf;
+	blk_t		blk;
 
 	server_reset(sv);
 
+	memset(&blk, 0, sizeof(blk));
+	crypto_generichash(	(void *) &sv->null_hash, sizeof(sv->null_hash),
+				(void *) &blk          , sizeof(blk          ),
+				NULL, 0);
+
 	sv->sock_fd = sock_fd;
 
 	if (stat(root_path, &statbuf) != 0)
@@ -276,6 +409,8 @@ int server_run(server_t *sv)
 			case CMD_SYNC	: try_fn(0, server_synccl, sv);	break;
 			case CMD_RD_BLK	: try_fn(0, server_rd_blk, sv);	break;
 			case CMD_WR_BLK	: try_fn(0, server_wr_blk, sv);	break;
+			case CMD_TRIM	: try_fn(0, server_trim, sv);	break;
+			case CMD_CP_BLK	: try_fn(0, server_cp_blk, sv);	break;
 		}
 	}
 
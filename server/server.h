@@ -11,6 +11,7 @@ typedef struct
 	int		aead_fd;
 	int		tree_fd;
 	mtree_t *	mtree;
+	hash_t		null_hash;
 } server_t;
 
 int	server_start	(server_t *sv, int sock_fd, const char *root_path);